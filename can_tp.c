@@ -0,0 +1,412 @@
+/* ISO-TP (ISO 15765-2) transport on HCAN0, for SH7058 ECUs with CAN on the OBD port.
+ *
+ * Polled, no interrupts. Normal addressing with 11-bit IDs : requests are received on CAN_RXID,
+ * responses are sent on CAN_TXID; all frames are padded to 8 bytes.
+ * The payload is the same as a K-line frame without header and checksum, i.e. <SID> <data...>
+ *
+ * The HCAN module standby bit and pin functions are left as set up by the ECU firmware. If that
+ * firmware never started HCAN0, the reset handshake times out and CAN stays off : K-line only.
+ */
+
+#include "stypes.h"
+#include "platf.h"
+
+#if defined(CAN_TRANSPORT)
+
+#include <string.h>	//memcpy
+#include "reg_defines/7055_7058_180nm.h"
+#include "can_tp.h"
+
+#ifndef HCAN
+#define HCAN	HCAN0	//the host tests substitute a model, see test/test_can_tp.c
+#endif
+
+#define CAN_RXID	0x7E0
+#define CAN_TXID	0x7E8
+#define CAN_PAD	0x55
+
+/* bit timing, Pclk = 20MHz : tq = 2 * (BRP + 1) / Pclk = 100ns.
+ * 1 + (TSEG1 + 1) + (TSEG2 + 1) = 20 tq per bit, i.e. 500kbps; sample point @ 70%
+ */
+#define CAN_BRP	0
+#define CAN_TSEG1	12
+#define CAN_TSEG2	5
+#define CAN_SJW	1
+
+#define MB_RX	0	//MB0 can only receive
+#define MB_TX	1
+#define MBC_TX	0	//MBC field : data frame transmission
+#define MBC_RX	2	//MBC field : data frame reception
+#define MBC_OFF	7	//MBC field : mailbox inactive
+
+/* PCI types (high nibble of first byte) */
+#define PCI_SF	0x00
+#define PCI_FF	0x10
+#define PCI_CF	0x20
+#define PCI_FC	0x30
+
+/* FlowStatus */
+#define FS_CTS	0
+#define FS_WAIT	1
+#define FS_OVFLW	2
+
+#define N_TIMEOUT	1000	//ms; used for N_Bs (waiting for FC) and N_Cr (waiting for CF)
+#define HCAN_TIMEOUT	10	//ms; reset handshake, TX abort. Takes a few bit times on a working HCAN
+
+static bool can_up = 0;	//HCAN0 initialized and responsive; else every call is a no-op
+
+/* FlowControl parameters sent for multi-frame requests, see SID_CONF_CANTP */
+static u8 fc_bs = 0;	//BlockSize, 0 = no further FC
+static u8 fc_stmin = 0;	//STmin, ISO 15765-2 encoding
+
+/* multi-frame reception in progress */
+static bool rx_busy = 0;
+static unsigned rx_len;
+static unsigned rx_pos;
+static u8 rx_sn;	//next expected SequenceNumber
+static u8 rx_bscnt;	//CFs received in the current block
+static u32 rx_lastts;
+
+/* source for can_send() */
+static const struct tx_seg *tx_seg;	//current segment
+static unsigned tx_pos;	//within current segment
+
+
+/** wait for GSR.RSB (reset / halt state) to become rsb.
+ * @return 0 if HCAN_TIMEOUT expired first
+ */
+static bool can_waitrsb(bool rsb) {
+	u32 t0 = get_mclk_ts();
+
+	while (HCAN.GSR.BIT.RSB != rsb) {
+		if ((get_mclk_ts() - t0) >= MCLK_GETTS(HCAN_TIMEOUT)) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/** @return 0 if HCAN0 doesn't respond (module stopped, no clock) : CAN stays off */
+bool can_init(void) {
+	unsigned mb;
+
+	can_up = 0;
+	rx_busy = 0;
+
+	HCAN.MCR.BIT.RSTRQ = 1;
+	if (!can_waitrsb(1)) {
+		return 0;
+	}
+	HCAN.IRR.WORD = 0x0001;	//clear RHSIF (reset interrupt flag)
+
+	HCAN.BCR0.WORD = CAN_BRP;
+	HCAN.BCR1.WORD = (CAN_TSEG1 << 12) | (CAN_TSEG2 << 8) | (CAN_SJW << 4);
+	HCAN.IMR.WORD = 0xFFFF;	//polled : mask everything
+	HCAN.MBIMR0.WORD = 0xFFFF;
+	HCAN.MBIMR1.WORD = 0xFFFF;
+
+	for (mb = 0; mb < 32; mb++) {
+		HCAN.MB[mb].CTRLL.BIT.MBC = MBC_OFF;
+	}
+
+	HCAN.MB[MB_RX].CTRLH.WORD = CAN_RXID << 4;	//STID; RTR = IDE = 0
+	HCAN.MB[MB_RX].LAFMH.WORD = 0;	//all ID bits must match
+	HCAN.MB[MB_RX].LAFML.WORD = 0;
+	HCAN.MB[MB_RX].CTRLL.BIT.MBC = MBC_RX;
+
+	HCAN.MB[MB_TX].CTRLH.WORD = CAN_TXID << 4;
+	HCAN.MB[MB_TX].CTRLL.BIT.DLC = 8;
+	HCAN.MB[MB_TX].CTRLL.BIT.MBC = MBC_TX;
+
+	HCAN.MCR.BIT.RSTRQ = 0;
+	if (!can_waitrsb(0)) {
+		return 0;
+	}
+
+	can_up = 1;
+	return 1;
+}
+
+bool can_isup(void) {
+	return can_up;
+}
+
+/** @return 1 while a multi-frame request is being reassembled (buf passed to can_poll() in use) */
+bool can_rxbusy(void) {
+	return rx_busy;
+}
+
+/** set FlowControl parameters for subsequent requests */
+void can_setfc(u8 bs, u8 stmin) {
+	fc_bs = bs;
+	fc_stmin = stmin;
+	return;
+}
+
+/** wait until the TX mailbox is free. Gives up (and aborts the frame) after N_TIMEOUT, e.g. if bus-off.
+ * If even the abort doesn't complete, CAN is turned off.
+ */
+void can_txwait(void) {
+	u32 t0 = get_mclk_ts();
+
+	if (!can_up) {
+		return;
+	}
+	while (HCAN.TXPR0.WORD & (1 << MB_TX)) {
+		if ((get_mclk_ts() - t0) >= MCLK_GETTS(N_TIMEOUT)) {
+			HCAN.TXCR0.WORD = 1 << MB_TX;
+			t0 = get_mclk_ts();
+			while (HCAN.TXPR0.WORD & (1 << MB_TX)) {
+				if ((get_mclk_ts() - t0) >= MCLK_GETTS(HCAN_TIMEOUT)) {
+					can_up = 0;
+					return;
+				}
+			}
+			break;
+		}
+	}
+	return;
+}
+
+static void can_txframe(const u8 *f) {
+	unsigned i;
+
+	can_txwait();
+	if (!can_up) {
+		return;
+	}
+	for (i = 0; i < 8; i++) {
+		HCAN.MB[MB_TX].MSG_DATA[i] = f[i];
+	}
+	HCAN.TXACK0.WORD = 1 << MB_TX;	//clear previous ack
+	HCAN.TXPR0.WORD = 1 << MB_TX;
+	return;
+}
+
+/** copy a received frame to f[8] and release the mailbox.
+ * @return DLC, 0 if nothing received
+ */
+static unsigned can_rxframe(u8 *f) {
+	unsigned i, dlc;
+
+	if (!(HCAN.RXPR0.WORD & (1 << MB_RX))) {
+		return 0;
+	}
+	dlc = HCAN.MB[MB_RX].CTRLL.BIT.DLC;
+	if (dlc > 8) {
+		dlc = 8;
+	}
+	for (i = 0; i < 8; i++) {
+		f[i] = HCAN.MB[MB_RX].MSG_DATA[i];
+	}
+	HCAN.RXPR0.WORD = 1 << MB_RX;	//write 1 to clear
+	return dlc;
+}
+
+static void can_sendfc(u8 fs) {
+	u8 f[8];
+
+	memset(f, CAN_PAD, 8);
+	f[0] = PCI_FC | fs;
+	f[1] = fc_bs;
+	f[2] = fc_stmin;
+	can_txframe(f);
+	return;
+}
+
+/** poll for an incoming request; multi-frame requests are reassembled in buf[], across calls.
+ * buf must be the same for every call.
+ * @return length of a complete request, 0 if none yet
+ */
+unsigned can_poll(u8 *buf, unsigned maxlen) {
+	u8 f[8];
+	unsigned dlc, len;
+
+	if (!can_up) {
+		return 0;
+	}
+	if (rx_busy && ((get_mclk_ts() - rx_lastts) >= MCLK_GETTS(N_TIMEOUT))) {
+		rx_busy = 0;	//N_Cr timeout : drop partial request
+	}
+
+	dlc = can_rxframe(f);
+	if (!dlc) {
+		return 0;
+	}
+
+	switch (f[0] & 0xF0) {
+	case PCI_SF:
+		len = f[0] & 0x0F;
+		if ((len == 0) || (len >= dlc) || (len > maxlen)) {
+			return 0;
+		}
+		rx_busy = 0;	//a new SF interrupts any multi-frame request
+		memcpy(buf, &f[1], len);
+		return len;
+	case PCI_FF:
+		len = ((f[0] & 0x0F) << 8) | f[1];
+		if ((dlc < 8) || (len < 8)) {
+			return 0;
+		}
+		if (len > maxlen) {
+			rx_busy = 0;
+			can_sendfc(FS_OVFLW);
+			return 0;
+		}
+		memcpy(buf, &f[2], 6);
+		rx_len = len;
+		rx_pos = 6;
+		rx_sn = 1;
+		rx_bscnt = 0;
+		rx_busy = 1;
+		rx_lastts = get_mclk_ts();
+		can_sendfc(FS_CTS);
+		return 0;
+	case PCI_CF:
+		if (!rx_busy) {
+			return 0;
+		}
+		if ((f[0] & 0x0F) != rx_sn) {
+			rx_busy = 0;	//lost a frame : abort
+			return 0;
+		}
+		len = rx_len - rx_pos;
+		if (len > 7) {
+			len = 7;
+		}
+		if (len >= dlc) {
+			rx_busy = 0;
+			return 0;
+		}
+		memcpy(&buf[rx_pos], &f[1], len);
+		rx_pos += len;
+		rx_sn = (rx_sn + 1) & 0x0F;
+		rx_lastts = get_mclk_ts();
+		if (rx_pos == rx_len) {
+			rx_busy = 0;
+			return rx_len;
+		}
+		if (fc_bs && (++rx_bscnt == fc_bs)) {
+			rx_bscnt = 0;
+			can_sendfc(FS_CTS);
+		}
+		return 0;
+	default:
+		//FC outside of a transmission, or reserved PCI : ignore
+		return 0;
+	}
+}
+
+/* convert STmin to MCLK ticks */
+static u32 stmin_ticks(u8 st) {
+	if (st <= 0x7F) {
+		return MCLK_GETTS(st);
+	}
+	if ((st >= 0xF1) && (st <= 0xF9)) {
+		return MCLK_GETTS(st - 0xF0) / 10;	//100us units
+	}
+	return MCLK_GETTS(0x7F);	//reserved : use max
+}
+
+/** wait for a FC from the tester.
+ * @return 0 if the transmission must be aborted (overflow, timeout)
+ */
+static bool can_waitfc(u8 *bs, u32 *st) {
+	u8 f[8];
+	u32 t0 = get_mclk_ts();
+
+	while ((get_mclk_ts() - t0) < MCLK_GETTS(N_TIMEOUT)) {
+		if (!can_rxframe(f)) {
+			continue;
+		}
+		if ((f[0] & 0xF0) != PCI_FC) {
+			continue;	//requests are not accepted while transmitting
+		}
+		switch (f[0] & 0x0F) {
+		case FS_CTS:
+			*bs = f[1];
+			*st = stmin_ticks(f[2]);
+			return 1;
+		case FS_WAIT:
+			t0 = get_mclk_ts();
+			break;
+		default:
+			return 0;
+		}
+	}
+	return 0;
+}
+
+static void tx_get(u8 *dst, unsigned n) {
+	while (n) {
+		while (tx_pos == tx_seg->len) {
+			tx_seg++;
+			tx_pos = 0;
+		}
+		*dst = tx_seg->p[tx_pos];
+		tx_pos += 1;
+		dst++;
+		n--;
+	}
+	return;
+}
+
+/** send a response made of several segments. Blocks until the last frame is queued */
+void can_send(const struct tx_seg *seg, unsigned nseg) {
+	u8 f[8];
+	unsigned len = 0;
+	unsigned n;
+	unsigned blkleft;	//CFs left in the current block
+	u8 sn;
+	u8 bs;
+	u32 st = 0;
+	u32 t_last = 0;
+
+	for (n = 0; n < nseg; n++) {
+		len += seg[n].len;
+	}
+	if (!can_up || (len == 0) || (len > CAN_MAXMSG)) {
+		return;
+	}
+	tx_seg = seg;
+	tx_pos = 0;
+
+	memset(f, CAN_PAD, 8);
+	if (len <= 7) {
+		f[0] = PCI_SF | len;
+		tx_get(&f[1], len);
+		can_txframe(f);
+		return;
+	}
+
+	f[0] = PCI_FF | (len >> 8);
+	f[1] = len & 0xFF;
+	tx_get(&f[2], 6);
+	can_txframe(f);
+	len -= 6;
+
+	sn = 1;
+	blkleft = 0;
+	while (len && can_up) {
+		if (blkleft == 0) {
+			if (!can_waitfc(&bs, &st)) {
+				return;
+			}
+			blkleft = bs ? bs : (unsigned) -1;
+		} else {
+			while ((get_mclk_ts() - t_last) < st) {}
+		}
+		n = (len > 7) ? 7 : len;
+		memset(f, CAN_PAD, 8);
+		f[0] = PCI_CF | sn;
+		tx_get(&f[1], n);
+		can_txframe(f);
+		t_last = get_mclk_ts();
+		len -= n;
+		sn = (sn + 1) & 0x0F;
+		blkleft -= 1;
+	}
+	return;
+}
+
+#endif	//CAN_TRANSPORT
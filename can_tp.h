@@ -0,0 +1,17 @@
+#ifndef _CAN_TP_H
+#define _CAN_TP_H
+
+#include "stypes.h"
+#include "cmd_parser.h"	//struct tx_seg
+
+#define CAN_MAXMSG	4095	//ISO-TP length limit (12-bit FF_DL)
+
+bool can_init(void);
+bool can_isup(void);
+bool can_rxbusy(void);
+unsigned can_poll(u8 *buf, unsigned maxlen);
+void can_send(const struct tx_seg *seg, unsigned nseg);
+void can_txwait(void);
+void can_setfc(u8 bs, u8 stmin);
+
+#endif
@@ -22,6 +22,9 @@
 #include <string.h>	//memcpy
 
 #include "reg_defines/7055_7058_180nm.h"	//required for SCI stuff
+#include "ivect.h"	//ISR attribute
+#include "functions.h"
+#include "extra_functions.h"	//imask_savedisable()
 #include "npk_ver.h"
 #include "platf.h"
 
@@ -29,8 +32,13 @@
 #include "iso_cmds.h"
 #include "npk_errcodes.h"
 #include "crc.h"
+#include "fec.h"
+#include "lz.h"
+#include "sha256.h"
+#include "can_tp.h"
+#include "cmd_parser.h"
 
-#define MAX_INTERBYTE	10	//ms between bytes that causes a disconnect
+#define SESS_TIMEOUT	5000	//default ms without a valid frame before dropping the session, see SID_CONF_SESSMODE and SID_ATP
 
 extern void die(void);
 
@@ -39,16 +47,38 @@ extern void die(void);
  */
 static const u8 npk_ver_string[] = SID_RECUID_PRC NPK_VER;
 
+/* Extended frames, see SID_CONF_EXTFRAME : <0x40> <LENH> <LENL> <data...> <CRCH> <CRCL>
+ * (FMT 0x40 is "CARB mode" in iso14230, otherwise unused here)
+ */
+#define EXT_FMT	0x40
+#define EXT_MAXDATA	2016	//max data length, limited by the RBIG area (msg + rxhist)
+
 /* make receiving slightly easier maybe */
 struct iso14230_msg {
-	int	hdrlen;		//expected header length : 1 (len-in-fmt), 2(fmt + len), 3(fmt+addr), 4(fmt+addr+len)
+	int	hdrlen;		//expected header length : 1 (len-in-fmt), 2(fmt + len), 3(fmt+addr), 4(fmt+addr+len) or 3 (extended)
 	int	datalen;	//expected data length
 	int	hi;		//index in hdr[]
 	int	di;		//index in data[]
+	bool	ext;	//extended frame : 16-bit length, CRC16
+	u8	cks;	//running checksum
+	u16	crc;	//running CRC16, if extended
+	u8	*sdst;	//if set, data bytes from data[sofs] on are stored at sdst instead; see rx_streamsetup()
+	int	sofs;
 	u8	hdr[4];
-	u8	data[256];	//255 data bytes + checksum
+	u8	data[EXT_MAXDATA + 2];	//data bytes + checksum (1 byte), or CRC16 if extended
 };
 
+/* per-session counters, see SID_CONF_STATS. Reset by StartComm. Saturated at 0xFFFF */
+static struct {
+	u16 goodframes;
+	u16 badframes;	//bad header / checksum, or partial frame dropped
+	u16 lineerrs;	//ORER | FER | PER, RX ring overflow
+	u16 nrcs;	//negative responses sent (rejected requests)
+	u16 fecfixes;	//frames repaired by FEC
+} sstats;
+
+#define SAT_INC16(x) do { if ((x) < 0xFFFF) (x) += 1; } while (0)
+
 /** simple 8-bit sum */
 uint8_t cks_u8(const uint8_t * data, unsigned int len) {
 	uint8_t rv=0;
@@ -74,6 +104,203 @@ static u32 reconst_24(const u8 *data) {
 	return tmp;
 }
 
+/** store val as a big-endian value of 'bytes' bytes; @return dst + bytes */
+static u8 *put_be(u8 *dst, u32 val, unsigned bytes) {
+	while (bytes) {
+		bytes -= 1;
+		*dst++ = val >> (8 * bytes);
+	}
+	return dst;
+}
+
+/** read a big-endian value of 'bytes' bytes */
+static u32 get_be(const u8 *src, unsigned bytes) {
+	u32 val = 0;
+
+	while (bytes) {
+		bytes -= 1;
+		val = (val << 8) | *src++;
+	}
+	return val;
+}
+
+/** SCI1 RX ring buffer, filled by the RXI / ERI interrupts.
+ * Single producer (ISR) / single consumer (cmd_loop) : only the ISR writes rx_head,
+ * only the consumer writes rx_tail, so no locking is required.
+ * Each entry is the received byte in the low 8 bits, plus RXF_* flags.
+ * This lets the host queue the next request while a handler (erase, write, dump) is running.
+ */
+#define RXBUF_SIZE	512	//must be a power of 2; enough for one max-length frame + change
+#define RXF_ERR	0x100	//line error (ORER | FER | PER, or ring overflow) occured before this byte
+#define RXF_GAP	0x200	//more than P1_MAX elapsed since the previous byte
+
+static volatile u16 rxbuf[RXBUF_SIZE] XBUF;
+static volatile unsigned rx_head;	//next write pos; written by ISR only
+static volatile unsigned rx_tail;	//next read pos; written by consumer only
+static volatile u16 rx_flags;	//pending RXF_* flags, applied to the next received byte
+static volatile u32 rx_lastts;	//timestamp of previous byte; written by ISR only
+
+void INT_SCI1_RXI1(void) ISR;
+void INT_SCI1_RXI1(void) {
+	unsigned next;
+	u16 entry;
+	u32 ts;
+
+	ts = get_mclk_ts();
+	entry = SCI1.RDR | rx_flags;
+	SCI1.SSR.BIT.RDRF = 0;
+
+	if ((ts - rx_lastts) > MCLK_GETTS(P1_MAX)) {
+		entry |= RXF_GAP;
+	}
+	rx_lastts = ts;
+
+	next = (rx_head + 1) & (RXBUF_SIZE - 1);
+	if (next == rx_tail) {
+		//ring full : drop byte, treat like an overrun
+		rx_flags = RXF_ERR;
+		return;
+	}
+	rxbuf[rx_head] = entry;
+	rx_head = next;
+	rx_flags = 0;
+	return;
+}
+
+/* ORER | FER | PER : clear flags so RX can continue, and mark the stream */
+void INT_SCI1_ERI1(void) ISR;
+void INT_SCI1_ERI1(void) {
+	SCI1.SSR.BYTE &= 0x87;	//clear RDRF + error flags
+	rx_flags = RXF_ERR;
+	return;
+}
+
+/** get next RX ring entry
+ * @return 0 if empty
+ */
+static bool sci_rxget(u16 *entry) {
+	unsigned tail = rx_tail;
+
+	if (tail == rx_head) return 0;
+	*entry = rxbuf[tail];
+	rx_tail = (tail + 1) & (RXBUF_SIZE - 1);
+	return 1;
+}
+
+/** SCI1 TX queue, drained by the TXI interrupt.
+ * Single producer (kline_sendsg) / single consumer (ISR), same scheme as the RX ring.
+ * RX is disabled while the queue is active to remove the halfdup echo, and re-enabled
+ * by the TEI interrupt once the stop bit of the last byte is out.
+ */
+#define TXBUF_SIZE	512	//must be a power of 2
+
+static volatile u8 txq[TXBUF_SIZE] XBUF;
+static volatile unsigned tx_head;	//next write pos; written by producer only
+static volatile unsigned tx_tail;	//next read pos; written by ISR only
+static volatile bool tx_active;	//set when queueing, cleared by TEI
+
+/** modify SCI1.SCR without racing the TX ISRs, which also touch it */
+static void sci_scrmod(u8 clr, u8 set) {
+	unsigned uim;
+
+	uim = imask_savedisable();
+	SCI1.SCR.BYTE = (SCI1.SCR.BYTE & ~clr) | set;
+	imask_restore(uim);
+	return;
+}
+
+void INT_SCI1_TXI1(void) ISR;
+void INT_SCI1_TXI1(void) {
+	unsigned tail = tx_tail;
+
+	if (tail == tx_head) {
+		//queue empty : wait for end of last byte (TEI) before re-enabling RX
+		SCI1.SCR.BYTE = (SCI1.SCR.BYTE & 0x7F) | 0x04;	//TIE = 0, TEIE = 1
+		return;
+	}
+	SCI1.TDR = txq[tail];
+	SCI1.SSR.BIT.TDRE = 0;		//start tx
+	tx_tail = (tail + 1) & (TXBUF_SIZE - 1);
+	return;
+}
+
+void INT_SCI1_TEI1(void) ISR;
+void INT_SCI1_TEI1(void) {
+	SCI1.SCR.BYTE = (SCI1.SCR.BYTE & ~0x04) | 0x10;	//TEIE = 0, RE = 1
+	tx_active = 0;
+	return;
+}
+
+/** start or continue draining the TX queue : RE = 0, TEIE = 0, TIE = 1.
+ * tx_active is set with interrupts masked, so a TEI from the previous burst can't clear it
+ * between setting it and re-enabling TIE.
+ */
+static void sci_txkick(void) {
+	unsigned uim;
+
+	uim = imask_savedisable();
+	tx_active = 1;
+	SCI1.SCR.BYTE = (SCI1.SCR.BYTE & ~0x14) | 0x80;
+	imask_restore(uim);
+	return;
+}
+
+/** append to TX queue; only blocks if the queue is full. For use by kline_sendsg() only
+ * @return 8-bit sum of the queued bytes
+ */
+static u8 sci_txqueue(const uint8_t *buf, uint32_t len) {
+	u8 sum = 0;
+
+	for (; len > 0; len--) {
+		unsigned head = tx_head;
+		unsigned next = (head + 1) & (TXBUF_SIZE - 1);
+
+		if (next == tx_tail) {
+			sci_txkick();
+			while (next == tx_tail) {}	//wait for room
+		}
+		txq[head] = *buf;
+		sum += *buf;
+		buf++;
+		tx_head = next;
+	}
+	sci_txkick();
+	return sum;
+}
+
+/** queue a short frame without waiting, from the WDT ISR : dropped if the queue lacks room.
+ * Only while the main loop is not transmitting (see rsppend_arm), so there is still a single producer.
+ */
+static void sci_txpush(const u8 *buf, unsigned len) {
+	unsigned head = tx_head;
+
+	if (((tx_tail - head - 1) & (TXBUF_SIZE - 1)) < len) return;
+	for (; len > 0; len--) {
+		txq[head] = *buf++;
+		head = (head + 1) & (TXBUF_SIZE - 1);
+	}
+	tx_head = head;
+	sci_txkick();
+	return;
+}
+
+/** wait until everything queued is sent and RX is back on.
+ * Required before touching BRR, or before dying.
+ */
+static void sci_txwait(void) {
+	while (tx_active) {}
+	return;
+}
+
+/** discard everything in the RX ring, including pending error flags */
+static void sci_rxflush(void) {
+	sci_scrmod(0x40, 0);	//RIE = 0
+	rx_tail = rx_head;
+	rx_flags = 0;
+	sci_scrmod(0, 0x40);
+	return;
+}
+
 /** discard RX data until idle for a given time
  * @param idle : purge until interbyte > idle ms
  *
@@ -85,65 +312,134 @@ static void sci_rxidle(unsigned ms) {
 	if (ms > MCLK_MAXSPAN) ms = MCLK_MAXSPAN;
 	intv = MCLK_GETTS(ms);	//# of ticks for delay
 
+	sci_rxflush();
 	t0 = get_mclk_ts();
 	while (1) {
 		tc = get_mclk_ts();
 		if ((tc - t0) >= intv) return;
 
-		if (SCI1.SSR.BYTE & 0x78) {
-			/* RDRF | ORER | FER | PER :reset timer */
+		if ((rx_head != rx_tail) || rx_flags) {
+			/* new data or error : reset timer */
+			sci_rxflush();
 			t0 = get_mclk_ts();
-			SCI1.SSR.BYTE &= 0x87;	//clear RDRF + error flags
 		}
 	}
 }
 
-/** send a whole buffer, blocking. For use by iso_sendpkt() only */
-static void sci_txblock(const uint8_t *buf, uint32_t len) {
-	for (; len > 0; len--) {
-		while (!SCI1.SSR.BIT.TDRE) {}	//wait for empty
-		SCI1.TDR = *buf;
-		buf++;
-		SCI1.SSR.BIT.TDRE = 0;		//start tx
-	}
+/* P2min : min delay between the last request byte and the response, see SID_ATP */
+static u32 p2min_ticks;
+
+/** wait for P2min, if not already transmitting */
+static void tx_p2wait(void) {
+	if (tx_active || !p2min_ticks) return;
+	while ((get_mclk_ts() - rx_lastts) < p2min_ticks) {}
+	return;
 }
 
-/** Send a headerless iso14230 packet
- * @param len is clipped to 0xff
+static bool ext_ok;	//extended frames enabled, see SID_CONF_EXTFRAME
+
+/** K-line : send a headerless iso14230 packet made of several segments, each sent from where it is
+ * (no staging copy). The checksum is summed while queueing.
+ * @param ext : send as extended frame (only if ext_ok). Total length is clipped to EXT_MAXDATA, or 0xff if !ext
  *
- * disables RX during sending to remove halfdup echo. Should be reliable since
+ * RX is disabled during sending to remove halfdup echo, see sci_txqueue(). Should be reliable since
  * we re-enable after the stop bit, so K should definitely be back up to '1' again
  *
- * this is blocking
+ * this only copies to the TX queue and returns, unless the queue is full.
+ * Segments can be reused immediately.
  */
-void iso_sendpkt(const uint8_t *buf, int len) {
-	u8 hdr[2];
-	uint8_t cks;
-	if (len <= 0) return;
-
-	if (len > 0xff) len = 0xff;
+static void kline_sendsg(const struct tx_seg *seg, unsigned nseg, bool ext) {
+	u8 hdr[3];
+	unsigned hlen;
+	unsigned len = 0;
+	unsigned i;
+	u8 cks;
+	u16 crc = 0;
+
+	for (i = 0; i < nseg; i++) {
+		len += seg[i].len;
+	}
+	if (len == 0) return;
+
+	tx_p2wait();
+
+	if (ext) {
+		if (len > EXT_MAXDATA) len = EXT_MAXDATA;
+		hdr[0] = EXT_FMT;
+		hdr[1] = len >> 8;
+		hdr[2] = len & 0xFF;
+		hlen = 3;
+		crc = crc16(hdr, 3);
+	} else if (len <= 0x3F) {
+		hdr[0] = (uint8_t) len;	//FMT/Len
+		hlen = 1;
+	} else {
+		if (len > 0xff) len = 0xff;
+		hdr[0] = 0;
+		hdr[1] = (uint8_t) len;	//Len
+		hlen = 2;
+	}
+	cks = sci_txqueue(hdr, hlen);
 
-	SCI1.SCR.BIT.RE = 0;
+	for (i = 0; len; i++) {
+		unsigned n = seg[i].len;
+		if (n > len) n = len;
+		if (ext) {
+			crc = crc16_update(crc, seg[i].p, n);
+		}
+		cks += sci_txqueue(seg[i].p, n);	//Payload
+		len -= n;
+	}
 
-	if (len <= 0x3F) {
-		hdr[0] = (uint8_t) len;
-		sci_txblock(hdr, 1);	//FMT/Len
+	if (ext) {
+		hdr[0] = crc >> 8;
+		hdr[1] = crc & 0xFF;
+		sci_txqueue(hdr, 2);
 	} else {
-		hdr[0] = 0;
-		hdr[1] = (uint8_t) len;
-		sci_txblock(hdr, 2);	//Len
+		sci_txqueue(&cks, 1);	//cks
 	}
+	return;
+}
+
+#ifdef CAN_TRANSPORT
+/** CAN : ISO-TP does its own segmentation, so there are no extended frames */
+static void can_sendsg(const struct tx_seg *seg, unsigned nseg, bool ext) {
+	(void) ext;
+	can_send(seg, nseg);
+	return;
+}
+#endif
+
+/* Transport of the request being handled : responses go back the same way.
+ * Selected by cmd_loop() for each received frame, before dispatching it.
+ */
+struct transport {
+	void (*sendsg)(const struct tx_seg *seg, unsigned nseg, bool ext);
+	bool segmented;	//ISO-TP : any response length, but no extended frames, FEC or raw streams
+};
 
-	sci_txblock(buf, len);	//Payload
+static const struct transport tp_kline = {kline_sendsg, 0};
+#ifdef CAN_TRANSPORT
+static const struct transport tp_can = {can_sendsg, 1};
+#endif
+static const struct transport *tport = &tp_kline;
 
-	cks = len;
-	cks += cks_u8(buf, len);
-	sci_txblock(&cks, 1);	//cks
+/** Send a response made of several segments on the current transport, see kline_sendsg() */
+static void iso_sendsg(const struct tx_seg *seg, unsigned nseg, bool ext) {
+	tport->sendsg(seg, nseg, ext);
+	return;
+}
 
-	//ugly : wait for transmission end; this means re-enabling RX won't pick up a partial byte
-	while (!SCI1.SSR.BIT.TEND) {}
+/** Send a headerless iso14230 packet from one buffer, see iso_sendsg().
+ * Sent as an extended frame if longer than 0xff and ext_ok
+ */
+void iso_sendpkt(const uint8_t *buf, int len) {
+	struct tx_seg seg;
 
-	SCI1.SCR.BIT.RE = 1;
+	if (len <= 0) return;
+	seg.p = buf;
+	seg.len = len;
+	iso_sendsg(&seg, 1, ext_ok && (len > 0xff));
 	return;
 }
 
@@ -158,6 +454,69 @@ void tx_7F(u8 sid, u8 nrc) {
 	buf[1]=sid;
 	buf[2]=nrc;
 	iso_sendpkt(buf, 3);
+	SAT_INC16(sstats.nrcs);
+}
+
+/* ResponsePending heartbeat : while armed, 7F <SID> 78 is sent from the WDT interrupt
+ * every P2max / 2, so the host can keep a short P2 timeout during long operations.
+ * Only arm while the main loop is not transmitting : the ISR then is the only producer.
+ * The ISR only queues the frame (no P2min wait, see sci_txpush) so the WDT pulse is never late;
+ * P2min is kept below the interval by SID_ATP, and the ISR fires an interval after arming.
+ */
+static volatile u8 rsppend_sid;	//0 : disarmed
+static volatile bool rsppend_due;	//heartbeat for rsppend_poll()
+static u32 rsppend_last;	//timestamp of arming / last heartbeat
+static u32 rsppend_ticks = MCLK_GETTS(50) / 2;	//interval, set by atp_apply()
+
+static void rsppend_arm(u8 sid) {
+	rsppend_last = get_mclk_ts();
+	rsppend_due = 0;
+	rsppend_sid = sid;
+	return;
+}
+
+static void rsppend_disarm(void) {
+	rsppend_sid = 0;
+	rsppend_due = 0;
+	return;
+}
+
+/** send the heartbeat flagged by cmd_tick(), on transports that can't be driven from the ISR (CAN).
+ * Called between steps of long operations; a single step (e.g. a block erase) isn't interrupted.
+ */
+static void rsppend_poll(void) {
+	u8 buf[3];
+
+	if (!rsppend_due) return;
+	rsppend_due = 0;
+	buf[0] = 0x7F;
+	buf[1] = rsppend_sid;
+	buf[2] = 0x78;	//requestCorrectlyReceived-ResponsePending
+	iso_sendpkt(buf, 3);
+	return;
+}
+
+/** periodic, called from WDT interrupt. Must not block */
+void cmd_tick(void) {
+	u8 buf[5];
+	u32 ts;
+
+	if (!rsppend_sid) return;
+	ts = get_mclk_ts();
+	if ((ts - rsppend_last) < rsppend_ticks) return;
+	rsppend_last = ts;
+
+	if (tport->segmented) {
+		rsppend_due = 1;	//never touch HCAN from here, see rsppend_poll()
+		return;
+	}
+	buf[0] = 3;	//FMT/Len
+	buf[1] = 0x7F;
+	buf[2] = rsppend_sid;
+	buf[3] = 0x78;	//requestCorrectlyReceived-ResponsePending
+	buf[4] = cks_u8(buf, 4);
+	sci_txpush(buf, 5);
+	return;
 }
 
 
@@ -166,7 +525,12 @@ void iso_clearmsg(struct iso14230_msg *msg) {
 	msg->datalen = 0;
 	msg->hi = 0;
 	msg->di = 0;
+	msg->ext = 0;
+	msg->cks = 0;
+	msg->crc = 0;
+	msg->sdst = NULL;
 }
+
 enum iso_prc { ISO_PRC_ERROR, ISO_PRC_NEEDMORE, ISO_PRC_DONE };
 /** Add newly-received byte to msg;
  *
@@ -174,7 +538,9 @@ enum iso_prc { ISO_PRC_ERROR, ISO_PRC_NEEDMORE, ISO_PRC_DONE };
  *	ISO_PRC_NEEDMORE if ok but msg not complete
  *	ISO_PRC_DONE when msg complete + good checksum
  *
- * Note : the *msg->hi, ->di, ->hdrlen, ->datalen memberes must be set to 0 before parsing a new message
+ * The checksum (or CRC) is summed as bytes arrive, so the frame is validated as soon as its last byte is in.
+ *
+ * Note : msg must be cleared with iso_clearmsg() before parsing a new message
  */
 
 enum iso_prc iso_parserx(struct iso14230_msg *msg, u8 newbyte) {
@@ -186,21 +552,26 @@ enum iso_prc iso_parserx(struct iso14230_msg *msg, u8 newbyte) {
 
 		//parse FMT byte
 		if ((newbyte & 0xC0) == 0x40) {
-			//CARB mode, not supported
-			return ISO_PRC_ERROR;
-		}
-		if (newbyte & 0x80) {
-			//addresses supplied
-			msg->hdrlen += 2;
-		}
-
-		dl = newbyte & 0x3f;
-		if (dl == 0) {
-			/* Additional length byte present */
-			msg->hdrlen += 1;
+			//CARB mode, not supported; except our extended frames
+			if (!ext_ok || (newbyte != EXT_FMT)) {
+				return ISO_PRC_ERROR;
+			}
+			msg->ext = 1;
+			msg->hdrlen = 3;	//FMT + 16-bit length
 		} else {
-			/* len-in-fmt : we can set length already */
-			msg->datalen = dl;
+			if (newbyte & 0x80) {
+				//addresses supplied
+				msg->hdrlen += 2;
+			}
+
+			dl = newbyte & 0x3f;
+			if (dl == 0) {
+				/* Additional length byte present */
+				msg->hdrlen += 1;
+			} else {
+				/* len-in-fmt : we can set length already */
+				msg->datalen = dl;
+			}
 		}
 	}
 
@@ -208,31 +579,196 @@ enum iso_prc iso_parserx(struct iso14230_msg *msg, u8 newbyte) {
 	if (msg->hi != msg->hdrlen) {
 		msg->hdr[msg->hi] = newbyte;
 		msg->hi += 1;
+		msg->cks += newbyte;
+		if (msg->ext) {
+			msg->crc = crc16_update(msg->crc, &newbyte, 1);
+		}
 		// fetch LEN byte if applicable
 		if ((msg->datalen == 0) && (msg->hi == msg->hdrlen)) {
-			msg->datalen = newbyte;
+			if (msg->ext) {
+				msg->datalen = (msg->hdr[1] << 8) | newbyte;
+				if ((msg->datalen == 0) || (msg->datalen > EXT_MAXDATA)) {
+					return ISO_PRC_ERROR;
+				}
+			} else {
+				msg->datalen = newbyte;
+			}
 		}
 		return ISO_PRC_NEEDMORE;
 	}
 
 	// ) here, header is complete. Add to data
+	if (msg->di < msg->datalen) {
+		if (msg->sdst && (msg->di >= msg->sofs)) {
+			msg->sdst[msg->di - msg->sofs] = newbyte;
+		} else {
+			msg->data[msg->di] = newbyte;
+		}
+		msg->di += 1;
+		if (msg->ext) {
+			msg->crc = crc16_update(msg->crc, &newbyte, 1);
+		} else {
+			msg->cks += newbyte;
+		}
+		return ISO_PRC_NEEDMORE;
+	}
+
+	// ) checksum byte(s)
 	msg->data[msg->di] = newbyte;
 	msg->di += 1;
 
-	// +1 because we need checksum byte too
-	if (msg->di != (msg->datalen + 1)) {
-		return ISO_PRC_NEEDMORE;
+	if (msg->ext) {
+		if (msg->di != (msg->datalen + 2)) {
+			return ISO_PRC_NEEDMORE;
+		}
+		if (msg->crc == ((msg->data[msg->datalen] << 8) | newbyte)) {
+			return ISO_PRC_DONE;
+		}
+		return ISO_PRC_ERROR;
 	}
 
-	// ) data now complete. valide cks
-	u8 cks = cks_u8(msg->hdr, msg->hdrlen);
-	cks += cks_u8(msg->data, msg->datalen);
-	if (cks == msg->data[msg->datalen]) {
+	if (msg->cks == newbyte) {
 		return ISO_PRC_DONE;
 	}
 	return ISO_PRC_ERROR;
 }
 
+/** if msg is a SID_WMBA request to the WSTREAM area, have iso_parserx() store the rest of its data
+ * straight at the destination. Called once the SID, address and size are in.
+ * The destination is modified even if the frame turns out to be bad, hence the restricted area.
+ * This saves the copy, not RAM : rxhist[] still keeps every raw byte for resync, and msg.data[]
+ * stays sized for a full frame.
+ */
+static void rx_streamsetup(struct iso14230_msg *msg) {
+	u32 addr;
+	unsigned siz;
+
+	if (msg->data[0] != SID_WMBA) return;
+	siz = msg->data[4];
+	if ((siz == 0) && msg->ext) {
+		siz = msg->datalen - 5;
+	}
+	if ((siz == 0) || (msg->datalen != (int) (siz + 5))) return;
+
+	addr = reconst_24(&msg->data[1]);
+	if ((addr < WSTREAM_MIN) || ((addr + siz - 1) > WSTREAM_MAX)) return;
+
+	msg->sdst = (u8 *) addr;
+	msg->sofs = 5;
+	return;
+}
+
+
+/* FEC mode, see SID_CONF_FEC. 0 : off, else interleave depth */
+static u8 fec_depth;
+
+/** true if frames with this SID carry FEC parity */
+static bool fec_isbulk(u8 sid) {
+	return (sid == SID_FLASH) || (sid == SID_WMBA);
+}
+
+/** FEC processing of a complete frame, when enabled.
+ * @param prv : iso_parserx() result, i.e. checksum status
+ * @return ISO_PRC_DONE if the frame is valid (repaired if needed), with parity stripped.
+ *
+ * A frame that fails the checksum is repaired if possible, since its SID may be one of the
+ * damaged bytes; a frame that passes the checksum but not FEC is rejected.
+ */
+static enum iso_prc fec_rxframe(struct iso14230_msg *msg, enum iso_prc prv) {
+	unsigned plen = 2 * fec_depth;
+	int rv;
+
+	if ((prv == ISO_PRC_DONE) && !fec_isbulk(msg->data[0])) return prv;
+	if (msg->datalen <= (int) plen) return ISO_PRC_ERROR;
+
+	rv = fec_correct(msg->data, msg->datalen - plen, fec_depth);
+	if (rv < 0) return ISO_PRC_ERROR;
+	if (rv > 0) {
+		u8 cks = cks_u8(msg->hdr, msg->hdrlen);
+		cks += cks_u8(msg->data, msg->datalen);
+		if (cks != msg->data[msg->datalen]) return ISO_PRC_ERROR;
+		SAT_INC16(sstats.fecfixes);
+	} else if (prv != ISO_PRC_DONE) {
+		//bad header or checksum byte
+		return prv;
+	}
+
+	if (!fec_isbulk(msg->data[0])) return ISO_PRC_ERROR;
+	msg->datalen -= plen;
+	return ISO_PRC_DONE;
+}
+
+/** send bulk response <h> <p>, followed by FEC parity if enabled.
+ * Sent as an extended frame (no FEC) if it doesn't fit in a standard one; caller makes sure ext_ok then.
+ */
+static void iso_sendbulk(const u8 *h, unsigned hlen, const u8 *p, unsigned plen) {
+	u8 parity[2 * FEC_MAXDEPTH];
+	struct tx_seg seg[3];
+	unsigned fl = (tport->segmented) ? 0 : (2 * fec_depth);
+	bool ext = ((hlen + plen + fl) > 0xFF);
+
+	seg[0].p = h;
+	seg[0].len = hlen;
+	seg[1].p = p;
+	seg[1].len = plen;
+	seg[2].p = parity;
+	seg[2].len = 0;
+	if (fl && !ext) {
+		fec_encode(h, hlen, p, plen, fec_depth, parity);
+		seg[2].len = fl;
+	}
+	iso_sendsg(seg, 3, ext);
+	return;
+}
+
+
+/* Resync history : raw bytes of the frame being parsed (always starting at rxhist[0]),
+ * followed by bytes still to be re-parsed after a bad frame.
+ * When a frame fails (bad header / checksum), only its first byte is dropped and the rest is
+ * parsed again, so the next valid frame is found at the first offset with a valid header +
+ * checksum instead of purging everything until the line goes idle.
+ *
+ * An 8-bit checksum matches by chance 1 time in 256, so a "frame" found inside the rejected
+ * frame's payload could be a phantom (e.g. 01 11 12 in a data block). A resynced frame is only
+ * accepted if it starts at or after the rejected frame's end (rxh_badend), follows an interbyte
+ * gap, or ends exactly at the last received byte. Otherwise everything is dropped until the line
+ * goes idle (rx_draining).
+ */
+#define RXHIST_SIZE	(3 + EXT_MAXDATA + 2)	//longest possible frame : extended hdr + data + CRC16
+
+static u8 rxhist[RXHIST_SIZE] BIGBUF;
+static unsigned rxh_pos;	//next byte to parse
+static unsigned rxh_len;	//valid bytes in rxhist[]
+static unsigned rxh_badend;	//bytes at the start of rxhist[] that were part of a rejected frame
+static bool rx_draining;	//dropping bytes until the next interbyte gap
+
+/** get next byte to parse : replayed history first, then RX ring.
+ * @return 0 if nothing available. RXF_* flags are only set on fresh bytes
+ *
+ * Never overflows since iso_parserx() can't accept more than RXHIST_SIZE bytes in a frame
+ */
+static bool rx_nextbyte(u16 *entry) {
+	if (rxh_pos < rxh_len) {
+		*entry = rxhist[rxh_pos];
+		rxh_pos += 1;
+		return 1;
+	}
+	if (!sci_rxget(entry)) return 0;
+	rxhist[rxh_len] = (u8) *entry;
+	rxh_len += 1;
+	rxh_pos = rxh_len;
+	return 1;
+}
+
+/** drop n bytes at the start of history; the rest will be re-parsed */
+static void rx_histdrop(unsigned n) {
+	rxh_badend = (rxh_badend > n) ? (rxh_badend - n) : 0;
+	rxh_len -= n;
+	memmove(rxhist, &rxhist[n], rxh_len);
+	rxh_pos = 0;
+	return;
+}
+
 
 /* Command state machine */
 static enum t_cmdsm {
@@ -247,29 +783,147 @@ static enum t_flashsm {
 	FL_READY,	//after doing init.
 } flashstate;
 
-/* initialize command parser state machine;
- * updates SCI1 settings : 62500 bps
+static bool sess_keep;	//keep states across line errors, see SID_CONF_SESSMODE
+static u32 t_lastframe;	//timestamp of last valid frame
+static u32 sess_ticks = MCLK_GETTS(SESS_TIMEOUT);	//session timeout (P3max)
+
+
+/* Link quality + speed negotiation, see SID_CONF_TRYSPEED.
+ * A divisor set with TRYSPEED must be committed within SPEED_TRYTIME or it's reverted to the last
+ * committed one. Once committed, if the error rate gets too high, fall back to the previously
+ * committed (slower) divisor.
+ */
+#define SPEED_TRYTIME	1000	//ms before an uncommitted speed change is reverted
+#define LQ_WINDOW	32	//frames per error-rate window
+#define LQ_MAXBAD	4	//bad frames + line errors per window that trigger a fallback
+
+static u8 brr_cur;	//current BRR divisor
+static u8 brr_ok;	//last committed divisor
+static u8 brr_fallback;	//previously committed divisor
+static bool speed_trying;	//brr_cur not committed yet
+static bool speed_nego;	//TRYSPEED used since the last SETSPEED : line errors are expected, keep the session
+static u32 t_trystart;
+static u8 lq_winframes, lq_winbad;	//current error-rate window
+static u8 probe_lineerr, probe_badframes;	//counts since last TRYSPEED, for SID_CONF_PROBE
+static bool rx_resyncing;	//so a bad frame is counted once, not once per resync attempt
+
+/** change BRR divisor without touching the session states.
  * beware the FER error flag, it disables further RX. So when changing BRR, if the host sends a byte
  * FER will be set, etc.
  */
+static void sci_setbrr(u8 brrdiv) {
+	sci_txwait();
+	SCI1.SCR.BYTE &= 0x0B;	//disable all interrupts + TX + RX
+	SCI1.BRR = brrdiv;		// speed = (div + 1) * 625k
+	SCI1.SSR.BYTE &= 0x87;	//clear RDRF + error flags
+	rx_tail = rx_head;
+	rx_flags = 0;
+	SCI1.SCR.BYTE |= 0x70;	//enable TX+RX + RX interrupts (RXI, ERI). TXI + TEI are enabled as needed
+	brr_cur = brrdiv;
+	return;
+}
+
+/** record a good or bad frame / line error for the error-rate window */
+static void lq_event(bool bad) {
+	lq_winframes += 1;
+	if (bad) lq_winbad += 1;
+
+	if (lq_winbad >= LQ_MAXBAD) {
+		if (!speed_trying && (brr_cur != brr_fallback)) {
+			brr_ok = brr_fallback;
+			sci_setbrr(brr_ok);
+		}
+	} else if (lq_winframes < LQ_WINDOW) {
+		return;
+	}
+	lq_winframes = 0;
+	lq_winbad = 0;
+	return;
+}
+
+/** count a line error (1) or a bad frame (0) */
+static void cnt_bad(bool lineerr) {
+	if (lineerr) {
+		if (probe_lineerr < 0xFF) probe_lineerr += 1;
+		SAT_INC16(sstats.lineerrs);
+	} else {
+		if (probe_badframes < 0xFF) probe_badframes += 1;
+		SAT_INC16(sstats.badframes);
+	}
+	lq_event(1);
+	return;
+}
+
+/** revert uncommitted speed change if needed. Called while idle */
+static void speed_poll(void) {
+	if (speed_trying && ((get_mclk_ts() - t_trystart) >= MCLK_GETTS(SPEED_TRYTIME))) {
+		speed_trying = 0;
+		sci_setbrr(brr_ok);
+	}
+	return;
+}
+
+/* initialize command parser state machine;
+ * updates SCI1 settings : 62500 bps
+ */
 
 void cmd_init(u8 brrdiv) {
 	cmstate = CM_IDLE;
 	flashstate = FL_IDLE;
-	SCI1.SCR.BYTE &= 0xCF;	//disable TX + RX
-	SCI1.BRR = brrdiv;		// speed = (div + 1) * 625k
-	SCI1.SSR.BYTE &= 0x87;	//clear RDRF + error flags
-	SCI1.SCR.BYTE |= 0x30;	//enable TX+RX , no RX interrupts for now
+	INTC.IPRK.BIT._SCI1 = 0x0A;	//above WDT prio, so RX is never delayed by it
+	sci_setbrr(brrdiv);
+	brr_ok = brrdiv;	//explicit setting : no automatic fallback
+	brr_fallback = brrdiv;
+	speed_trying = 0;
+	speed_nego = 0;
+	return;
+}
+
+/* SID 83 : AccessTimingParameters. Only P2min, P2max and P3max affect the kernel :
+ * it can always accept back-to-back requests (P3min = 0) with no interbyte delay (P4min = 0).
+ * It answers as soon as possible; long operations send ResponsePending every P2max / 2.
+ */
+enum atp_idx { ATP_P2MIN, ATP_P2MAX, ATP_P3MIN, ATP_P3MAX, ATP_P4MIN, ATP_NUM };
+
+static const u8 atp_limits[ATP_NUM] = {0, 1, 0, MCLK_MAXSPAN / 250, 0};
+static const u8 atp_defaults[ATP_NUM] = {0, 2, 0, SESS_TIMEOUT / 250, 0};	//previous fixed behaviour
+static u8 atp_cur[ATP_NUM] = {0, 2, 0, SESS_TIMEOUT / 250, 0};
+
+static void atp_apply(const u8 *tp) {
+	unsigned p2lim = ((tp[ATP_P2MAX] ? tp[ATP_P2MAX] : 1) * 25) / 2;	//half the heartbeat interval, 0.5ms units
+
+	memcpy(atp_cur, tp, ATP_NUM);
+	if (atp_cur[ATP_P2MIN] > p2lim) atp_cur[ATP_P2MIN] = p2lim;	//see cmd_tick()
+	p2min_ticks = MCLK_GETTS(atp_cur[ATP_P2MIN]) / 2;	//0.5ms units
+	sess_ticks = MCLK_GETTS(tp[ATP_P3MAX] * 250);	//250ms units
+	rsppend_ticks = MCLK_GETTS(tp[ATP_P2MAX] * 25) / 2;	//25ms units
+	if (!rsppend_ticks) rsppend_ticks = MCLK_GETTS(25) / 2;
 	return;
 }
 
+/* streaming dump state, see SID_DSTREAM */
+static u32 ds_addr;
+static u32 ds_len;
+static u16 ds_blk;	//block size; 0 if not started
+static u16 ds_nblk;
+static u8 ds_win;
+
 static void cmd_startcomm(void) {
 	// KW : noaddr;  len-in-fmt or lenbyte
 	static const u8 txbuf[3] = {0xC1, 0x67, 0x8F};
 	iso_sendpkt(txbuf, 3);
 	flashstate = FL_IDLE;
+	fec_depth = 0;
+	ext_ok = 0;
+	ds_blk = 0;
+	atp_apply(atp_defaults);
+	memset(&sstats, 0, sizeof(sstats));
 }
 
+#define DUMP_MAXPKT	254	//max data bytes per dump packet, with the SID byte this is the iso14230 limit
+#define DUMP_MAXEXT	(EXT_MAXDATA - 4)	//same, for extended frames (SID + seq #, even)
+static u16 dump_pktlen = 32;	//data bytes per dump packet; always even. See SID_CONF_DUMPLEN
+
 /* dump command processor, called from cmd_loop.
  * args[0] : address space (0: EEPROM 93cxx, 1: ROM)
  * args[1,2] : # of 32-byte blocks
@@ -281,19 +935,62 @@ static void cmd_startcomm(void) {
  * ex.: "00 00 02 00 01" dumps 64 bytes @ EEPROM 0x20 (== address 0x10 in 93C66)
  * ex.: "01 80 00 00 00" dumps 1MB of ROM@ 0x0
  *
+ * With SID_DUMP_SEQ set in args[0], each packet starts with its 16-bit sequence number.
+ * With SID_DUMP_LZ (ROM only), each packet then has a mode byte; packed blocks are compressed
+ * independently (see lz.c), so every packet still covers exactly maxpkt bytes of ROM.
  */
+/* SID_DUMP_LZ output, EEPROM dump packets, SID_SCATTER / SID_HASHMAP / SID_CONF_CAPS responses.
+ * Kept off the stack, which only has ~1.3K below the kernel (see .ld file) */
+static u8 xscratch[LZ_MAXBLK] XBUF __attribute ((aligned (4)));
+
+/** max data bytes per dump packet, after a header of hlen bytes (including SID)
+ * @param rom : extended frames (or CAN) may be used, else limited to standard frames
+ * @return at least 2 (even, for EEPROM words) : with a tiny SID_CONF_DUMPLEN the header doesn't fit,
+ * and the packet is made a bit longer than asked rather than empty.
+ */
+static int dump_maxpkt(int hlen, bool rom) {
+	int maxpkt = dump_pktlen;
+
+	if (!(ext_ok || tport->segmented) || !rom) {
+		//standard frames only
+		if (maxpkt > (DUMP_MAXPKT - (2 * fec_depth))) {
+			maxpkt = DUMP_MAXPKT - (2 * fec_depth);
+		}
+		maxpkt -= (hlen - 1);
+	}
+	if (maxpkt < 2) {
+		maxpkt = 2;
+	}
+	return maxpkt;
+}
+
 static void cmd_dump(struct iso14230_msg *msg) {
 	u32 addr;
 	u32 len;
 	u8 space;
 	u8 *args = &msg->data[1];	//skip SID byte
+	int maxpkt;
+	int hlen;	//packet header : resp code, + seq # if SID_DUMP_SEQ, + mode if SID_DUMP_LZ
+	u8 ph[4];
+	u16 pktno = 0;
+	bool lz;
 
 	if (msg->datalen != 6) {
 		tx_7F(SID_DUMP, 0x12);
 		return;
 	}
 
-	space = args[0];
+	space = args[0] & ~(SID_DUMP_SEQ | SID_DUMP_LZ);
+	lz = (args[0] & SID_DUMP_LZ) && (space == SID_DUMP_ROM);
+	hlen = (args[0] & SID_DUMP_SEQ) ? 3 : 1;
+	ph[0] = SID_DUMP + 0x40;
+	if (lz) hlen += 1;
+
+	maxpkt = dump_maxpkt(hlen, (space == SID_DUMP_ROM));
+	if (lz && (maxpkt > LZ_MAXBLK)) {
+		maxpkt = LZ_MAXBLK;
+	}
+
 	len = 32 * ((args[1] << 8) | args[2]);
 	addr = 32 * ((args[3] << 8) | args[4]);
 	switch (space) {
@@ -302,24 +999,23 @@ static void cmd_dump(struct iso14230_msg *msg) {
 		addr /= 2;	/* modify address to fit with eeprom 256*16bit org */
 		len &= ~1;	/* align to 16bits */
 		while (len) {
-			u16 pbuf[17];
-			u8 *pstart;	//start of ISO packet
-			u16 *ebuf=&pbuf[1];	//cheat : form an ISO packet with the pos resp code in pbuf[0]
-
+			u16 *ebuf = (u16 *) xscratch;	//DUMP_MAXPKT bytes max
 			int pktlen;
 			int ecur;
 
-			pstart = (u8 *)(pbuf) + 1;
-			*pstart = SID_DUMP + 0x40;
-
+			ph[1] = pktno >> 8;
+			ph[2] = pktno & 0xFF;
 			pktlen = len;
-			if (pktlen > 32) pktlen = 32;
+			if (pktlen > maxpkt) pktlen = maxpkt;
 
+			rsppend_arm(SID_DUMP);
 			for (ecur = 0; ecur < (pktlen / 2); ecur += 1) {
 				eep_read16((uint8_t) addr + ecur, (uint16_t *)&ebuf[ecur]);
 			}
-			iso_sendpkt(pstart, pktlen + 1);
+			rsppend_disarm();
+			iso_sendbulk(ph, hlen, (const u8 *) ebuf, pktlen);
 
+			pktno += 1;
 			len -= pktlen;
 			addr += (pktlen / 2);	//work in eeprom addresses
 		}
@@ -327,15 +1023,27 @@ static void cmd_dump(struct iso14230_msg *msg) {
 	case SID_DUMP_ROM:
 		/* dump from ROM */
 		while (len) {
-			u8 buf[33];
-
 			int pktlen;
+			const u8 *src = (const u8 *) addr;	//straight from ROM
+			unsigned plen;
 
-			buf[0] = SID_DUMP + 0x40;
+			ph[1] = pktno >> 8;
+			ph[2] = pktno & 0xFF;
 			pktlen = len;
-			if (pktlen > 32) pktlen = 32;
-			memcpy(&buf[1], (void *) addr, pktlen);
-			iso_sendpkt(buf, pktlen + 1);
+			if (pktlen > maxpkt) pktlen = maxpkt;
+			plen = pktlen;
+			if (lz) {
+				unsigned clen = lz_pack(src, pktlen, xscratch, pktlen - 1);
+
+				ph[hlen - 1] = SID_DUMP_LZRAW;
+				if (clen) {
+					ph[hlen - 1] = SID_DUMP_LZPACKED;
+					src = xscratch;
+					plen = clen;
+				}
+			}
+			iso_sendbulk(ph, hlen, src, plen);
+			pktno += 1;
 			len -= pktlen;
 			addr += pktlen;
 		}
@@ -349,27 +1057,178 @@ static void cmd_dump(struct iso14230_msg *msg) {
 }
 
 
-/* SID 34 : prepare for reflashing */
-static void cmd_flash_init(void) {
-	u8 txbuf[2];
-	u8 errval;
+/* Flash write staging : SIDFL_WB chunks of any length are accumulated in flpage[],
+ * and each page is written as soon as it is complete.
+ * A sequence of chunks must start on a page boundary and be contiguous; a new sequence can
+ * start whenever the staged page is complete (empty).
+ * If the last accepted chunk is received again (positive response lost), it is acknowledged
+ * without being written twice.
+ * A partial page is only written by SIDFL_FLUSH. Since its chunks were already ACKed, it is never
+ * discarded silently : erase and SIDFL_WWOPEN are refused while it is pending.
+ */
+static u8 flpage[SIDFL_WB_DLEN] XBUF;
+static u32 flpage_addr;	//address of flpage[0]
+static unsigned flpage_fill;	//# of bytes staged
+static u32 fl_laststart, fl_lastend;	//last accepted chunk
+static u8 fl_errnrc;	//first failed page write since the last SIDFL_FLUSH; 0 if none
+static u32 fl_erraddr;	//address of that page
+
+/* Windowed write, see SIDFL_WWOPEN : pages are written as they arrive, in any order, since
+ * each SIDFL_WWDATA frame is a complete page. Only the reception state needs to be kept :
+ * the first missing page, and a bitmap of the pages received after it.
+ */
+#define WW_WINDOW	64	//max pages in flight past the first missing one
 
-	if (!platf_flash_init(&errval)) {
-		tx_7F(SID_FLREQ, errval);
-		return;
-	}
+static bool ww_open;
+static u32 ww_addr;	//address of page #0
+static u16 ww_npages;
+static u16 ww_base;	//first missing page
+static u8 ww_map[WW_WINDOW / 8];	//bit n (LSB first) : page (ww_base + n) received
+static u8 ww_err;	//NRC of first failed write, 0 if none
 
-	txbuf[0] = 0x74;
-	iso_sendpkt(txbuf, 1);
-	flashstate = FL_READY;
+/* forget duplicate detection and windowed writes; after erase or SIDFL_WWOPEN.
+ * Caller must check that no partial page is staged.
+ */
+static void fl_stagereset(void) {
+	fl_laststart = 0;
+	fl_lastend = 0;
+	ww_open = 0;
 	return;
 }
 
-/* "one's complement" checksum; if adding causes a carry, add 1 to sum. Slightly better than simple 8bit sum
+/** write the staged page, padded with 0xFF (left erased).
+ * On failure, the page is dropped and recorded for SIDFL_FLUSH.
+ * @return 0 if ok, NRC otherwise
  */
-u8 cks_add8(u8 *data, unsigned len) {
-	u16 sum = 0;
-	for (; len; len--, data++) {
+static u32 fl_writepage(void) {
+	u32 rv;
+
+	memset(&flpage[flpage_fill], 0xFF, SIDFL_WB_DLEN - flpage_fill);
+	rv = platf_flash_wb(flpage_addr, (u32) flpage, SIDFL_WB_DLEN);
+	if (rv) {
+		if (!fl_errnrc) {
+			fl_errnrc = (rv & 0xFF) | 0x80;
+			fl_erraddr = flpage_addr;
+		}
+		fl_laststart = 0;
+		fl_lastend = 0;
+	}
+	flpage_fill = 0;
+	flpage_addr += SIDFL_WB_DLEN;
+	return rv;
+}
+
+/** stage a chunk, and write completed pages.
+ * @return 0 if ok, NRC otherwise
+ */
+static u32 fl_stage(u32 dest, const u8 *src, unsigned len) {
+	u32 rv;
+
+	if ((dest == fl_laststart) && ((dest + len) == fl_lastend)) {
+		//duplicate
+		return 0;
+	}
+
+	if (flpage_fill == 0) {
+		if (dest & (SIDFL_WB_DLEN - 1)) return PFWB_MISALIGNED;
+		flpage_addr = dest;
+	} else if (dest != (flpage_addr + flpage_fill)) {
+		return PFWB_SEQ;
+	}
+	fl_laststart = dest;
+	fl_lastend = dest + len;
+
+	while (len) {
+		unsigned n = SIDFL_WB_DLEN - flpage_fill;
+		if (n > len) n = len;
+
+		memcpy(&flpage[flpage_fill], src, n);
+		flpage_fill += n;
+		src += n;
+		len -= n;
+
+		if (flpage_fill == SIDFL_WB_DLEN) {
+			rv = fl_writepage();
+			if (rv) return rv;
+			rsppend_poll();
+		}
+	}
+	return 0;
+}
+
+/* SIDFL_FLUSH : write the partial page, and report + clear the first staging error */
+static void fl_flush(void) {
+	u8 resp[5];
+
+	if (flpage_fill) {
+		rsppend_arm(SID_FLASH);
+		(void) fl_writepage();
+		rsppend_disarm();
+	}
+	resp[0] = SID_FLASH + 0x40;
+	resp[1] = fl_errnrc;
+	put_be(&resp[2], fl_errnrc ? fl_erraddr : flpage_addr, 3);
+	fl_errnrc = 0;
+	iso_sendpkt(resp, 5);
+	return;
+}
+
+/** handle a SIDFL_WWDATA page; never answered.
+ * Duplicates, pages outside the window, and bad pages are ignored : they will show as missing.
+ */
+static void ww_rxpage(u16 seq, const u8 *data) {
+	unsigned off;
+	u32 rv;
+
+	if (!ww_open || ww_err) return;
+	if ((seq < ww_base) || (seq >= ww_npages)) return;
+	off = seq - ww_base;
+	if (off >= WW_WINDOW) return;
+	if (ww_map[off / 8] & (1 << (off % 8))) return;
+
+	rv = platf_flash_wb(ww_addr + ((u32) seq * SIDFL_WB_DLEN), (u32) data, SIDFL_WB_DLEN);
+	if (rv) {
+		ww_err = (rv & 0xFF) | 0x80;
+		return;
+	}
+	ww_map[off / 8] |= 1 << (off % 8);
+
+	/* slide window past received pages */
+	while (ww_map[0] & 1) {
+		unsigned i;
+		for (i = 0; i < (WW_WINDOW / 8); i++) {
+			ww_map[i] >>= 1;
+			if ((i + 1) < (WW_WINDOW / 8)) {
+				ww_map[i] |= ww_map[i + 1] << 7;
+			}
+		}
+		ww_base += 1;
+	}
+	return;
+}
+
+/* SID 34 : prepare for reflashing */
+static void cmd_flash_init(void) {
+	u8 txbuf[2];
+	u8 errval;
+
+	if (!platf_flash_init(&errval)) {
+		tx_7F(SID_FLREQ, errval);
+		return;
+	}
+
+	txbuf[0] = 0x74;
+	iso_sendpkt(txbuf, 1);
+	ww_open = 0;	//a staged partial page is kept for SIDFL_FLUSH
+	flashstate = FL_READY;
+	return;
+}
+
+/* "one's complement" checksum; if adding causes a carry, add 1 to sum. Slightly better than simple 8bit sum
+ */
+u8 cks_add8(u8 *data, unsigned len) {
+	u16 sum = 0;
+	for (; len; len--, data++) {
 		sum += *data;
 		if (sum & 0x100) sum += 1;
 		sum = (u8) sum;
@@ -404,6 +1263,7 @@ static void cmd_flash_utils(struct iso14230_msg *msg) {
 	u8 subcommand;
 	u8 txbuf[10];
 	u32 tmp;
+	unsigned len;
 
 	u32 rv = 0x10;
 
@@ -426,31 +1286,98 @@ static void cmd_flash_utils(struct iso14230_msg *msg) {
 			rv = 0x12;
 			goto exit_bad;
 		}
+		if (flpage_fill) {
+			rv = PFWB_PENDING;
+			goto exit_bad;
+		}
+		fl_stagereset();
+		rsppend_arm(SID_FLASH);
 		rv = platf_flash_eb(msg->data[2]);
+		rsppend_disarm();
 		if (rv) {
 			rv = (rv & 0xFF) | 0x80;	//make sure it's a valid extented NRC
 			goto exit_bad;
 		}
 		break;
 	case SIDFL_WB:
-		//format : <SID_FLASH> <SIDFL_WB> <A2> <A1> <A0> <D0>...<D127> <CRC>
-		if (msg->datalen != (SIDFL_WB_DLEN + 6)) {
+		//format : <SID_FLASH> <SIDFL_WB> <A2> <A1> <A0> <D0>...<Dn-1> <CRC>
+		if (msg->datalen < 7) {
 			rv = 0x12;
 			goto exit_bad;
 		}
+		len = msg->datalen - 6;
 
-		if (cks_add8(&msg->data[2], (SIDFL_WB_DLEN + 3)) != msg->data[SIDFL_WB_DLEN + 5]) {
+		if (cks_add8(&msg->data[2], (len + 3)) != msg->data[len + 5]) {
 			rv = 0x77;	//crcerror
 			goto exit_bad;
 		}
 
 		tmp = (msg->data[2] << 16) | (msg->data[3] << 8) | msg->data[4];
-		rv = platf_flash_wb(tmp, (u32) &msg->data[5], SIDFL_WB_DLEN);
+		rsppend_arm(SID_FLASH);
+		rv = fl_stage(tmp, &msg->data[5], len);
+		rsppend_disarm();
 		if (rv) {
 			rv = (rv & 0xFF) | 0x80;	//make sure it's a valid extented NRC
 			goto exit_bad;
 		}
 		break;
+	case SIDFL_WWOPEN:
+		//format : <SID_FLASH> <SIDFL_WWOPEN> <A2> <A1> <A0> <NH> <NL>
+		if (msg->datalen != 7) {
+			rv = 0x12;
+			goto exit_bad;
+		}
+		tmp = (msg->data[2] << 16) | (msg->data[3] << 8) | msg->data[4];
+		if (tmp & (SIDFL_WB_DLEN - 1)) {
+			rv = PFWB_MISALIGNED;
+			goto exit_bad;
+		}
+		if (flpage_fill) {
+			rv = PFWB_PENDING;
+			goto exit_bad;
+		}
+		fl_stagereset();
+		ww_addr = tmp;
+		ww_npages = (msg->data[5] << 8) | msg->data[6];
+		ww_base = 0;
+		memset(ww_map, 0, sizeof(ww_map));
+		ww_err = 0;
+		ww_open = 1;
+		break;
+	case SIDFL_WWDATA:
+		//format : <SID_FLASH> <SIDFL_WWDATA> <SEQH> <SEQL> <D0>...<D127> <CRC>
+		if ((msg->datalen == (SIDFL_WB_DLEN + 5)) &&
+			(cks_add8(&msg->data[2], SIDFL_WB_DLEN + 2) == msg->data[SIDFL_WB_DLEN + 4])) {
+			ww_rxpage((msg->data[2] << 8) | msg->data[3], &msg->data[4]);
+		}
+		return;	//no response
+		break;
+	case SIDFL_FLUSH:
+		//format : <SID_FLASH> <SIDFL_FLUSH>
+		if (msg->datalen != 2) {
+			rv = 0x12;
+			goto exit_bad;
+		}
+		fl_flush();
+		return;
+		break;
+	case SIDFL_WWSTAT:
+		//format : <SID_FLASH> <SIDFL_WWSTAT>
+		if (!ww_open) {
+			rv = 0x22;
+			goto exit_bad;
+		}
+		{
+		u8 sbuf[4 + sizeof(ww_map)];
+		sbuf[0] = SID_FLASH + 0x40;
+		sbuf[1] = ww_err;
+		sbuf[2] = ww_base >> 8;
+		sbuf[3] = ww_base & 0xFF;
+		memcpy(&sbuf[4], ww_map, sizeof(ww_map));
+		iso_sendpkt(sbuf, sizeof(sbuf));
+		}
+		return;
+		break;
 	case SIDFL_UNPROTECT:
 		//format : <SID_FLASH> <SIDFL_UNPROTECT> <~SIDFL_UNPROTECT>
 		if (msg->datalen != 3) {
@@ -562,8 +1489,7 @@ void cmd_rmba(struct iso14230_msg *msg) {
 	//format : <SID_RMBA> <AH> <AM> <AL> <SIZ>
 	/* response : <SID + 0x40> <D0>....<Dn> <AH> <AM> <AL> */
 
-	u32 addr;
-	u8 buf[255];
+	struct tx_seg seg[3];
 	int siz;
 
 	if (msg->datalen != 5) goto bad12;
@@ -571,21 +1497,402 @@ void cmd_rmba(struct iso14230_msg *msg) {
 
 	if ((siz == 0) || (siz > 251)) goto bad12;
 
-	addr = reconst_24(&msg->data[1]);
+	msg->data[0] = SID_RMBA + 0x40;	//cheat !
+	seg[0].p = msg->data;
+	seg[0].len = 1;
+	seg[1].p = (const u8 *) reconst_24(&msg->data[1]);	//straight from memory
+	seg[1].len = siz;
+	seg[2].p = &msg->data[1];
+	seg[2].len = 3;
 
-	buf[0] = SID_RMBA + 0x40;
-	memcpy(buf + 1, (void *) addr, siz);
+	iso_sendsg(seg, 3, 0);
+	return;
+
+bad12:
+	tx_7F(SID_RMBA, 0x12);
+	return;
+}
 
-	siz += 1;
-	buf[siz++] = msg->data[1];
-	buf[siz++] = msg->data[2];
-	buf[siz++] = msg->data[3];
 
-	iso_sendpkt(buf, siz);
+/** SHA-256 digest of a memory range */
+static void cmd_sha256(struct iso14230_msg *msg) {
+	//format : <SID_SHA256> <A2> <A1> <A0> <L2> <L1> <L0>
+	static struct sha256_ctx ctx XBUF;
+	u8 resp[1 + SHA256_DIGESTLEN];
+	const u8 *src;
+	u32 len;
+
+	if (msg->datalen != 7) {
+		tx_7F(SID_SHA256, 0x12);
+		return;
+	}
+
+	src = (const u8 *) reconst_24(&msg->data[1]);
+	len = get_be(&msg->data[4], 3);
+
+	rsppend_arm(SID_SHA256);
+	sha256_init(&ctx);
+	while (len) {
+		u32 n = (len > 0x1000) ? 0x1000 : len;
+		sha256_update(&ctx, src, n);
+		src += n;
+		len -= n;
+		rsppend_poll();
+	}
+	sha256_final(&ctx, &resp[1]);
+	rsppend_disarm();
+
+	resp[0] = SID_SHA256 + 0x40;
+	iso_sendpkt(resp, sizeof(resp));
+	return;
+}
+
+
+/** ROM hash map : crc of N consecutive chunks, or bitmap of the chunks that differ from the host's crcs */
+static void cmd_hashmap(struct iso14230_msg *msg) {
+	//format : <SID_HASHMAP> <MODE> <A2> <A1> <A0> <C2> <C1> <C0> <NH> <NL> [<crc 0> ... <crc N-1>]
+	unsigned mode = msg->data[1];
+	unsigned w = (mode & SID_HASHMAP_CRC32) ? 4 : 2;
+	unsigned max = (ext_ok || tport->segmented) ? sizeof(xscratch) : (DUMP_MAXPKT + 1);
+	const u8 *hcrc = &msg->data[10];
+	u32 addr;
+	u32 csize;
+	unsigned n;
+	unsigned idx;
+	unsigned rlen;
+
+	if (msg->datalen < 10) goto bad12;
+	if (mode & ~(SID_HASHMAP_CMP | SID_HASHMAP_CRC32)) goto bad12;
+	addr = reconst_24(&msg->data[2]);
+	csize = get_be(&msg->data[5], 3);
+	n = get_be(&msg->data[8], 2);
+	if ((csize < 128) || (csize > SID_HASHMAP_MAXCHUNK) || (n == 0)) goto bad12;
+
+	if (mode & SID_HASHMAP_CMP) {
+		if ((unsigned) msg->datalen != (10 + (n * w))) goto bad12;
+		rlen = 1 + ((n + 7) / 8);
+	} else {
+		if (msg->datalen != 10) goto bad12;
+		rlen = 1 + (n * w);
+	}
+	if (rlen > max) goto bad12;
+
+	memset(xscratch, 0, rlen);
+	rsppend_arm(SID_HASHMAP);
+	for (idx = 0; idx < n; idx++, addr += csize) {
+		u32 crc;
+
+		if (w == 4) {
+			crc = crc32_update(0, (const u8 *) addr, csize);
+		} else {
+			crc = crc16((const u8 *) addr, csize);
+		}
+
+		rsppend_poll();
+		if (!(mode & SID_HASHMAP_CMP)) {
+			put_be(&xscratch[1 + (idx * w)], crc, w);
+			continue;
+		}
+		if (crc != get_be(hcrc, w)) {
+			xscratch[1 + (idx / 8)] |= 0x80 >> (idx & 7);
+		}
+		hcrc += w;
+	}
+	rsppend_disarm();
+
+	xscratch[0] = SID_HASHMAP + 0x40;
+	iso_sendpkt(xscratch, rlen);
 	return;
 
 bad12:
-	tx_7F(SID_RMBA, 0x12);
+	tx_7F(SID_HASHMAP, 0x12);
+	return;
+}
+
+
+/** read a big-endian word of w bytes (2 or 4) */
+static u32 cks_read(u32 addr, unsigned w) {
+	if (w == 2) return *(const u16 *) addr;
+	return *(const u32 *) addr;
+}
+
+/** ROM checksum : sum and xor of w-byte words over host-described ranges, excluding the stored values */
+static void cmd_cksum(struct iso14230_msg *msg) {
+	//format : <SID_CKSUM> <W> <SA2> <SA1> <SA0> <XA2> <XA1> <XA0> [<A2> <A1> <A0> <L2> <L1> <L0>] ...
+	u8 resp[1 + (4 * 4)];
+	const u8 *rng;
+	unsigned w = msg->data[1];
+	unsigned nrng;
+	u32 sumloc, xorloc;
+	u32 sum = 0, xor = 0;
+	u8 *cur;
+
+	if ((msg->datalen < 14) || ((msg->datalen - 8) % 6)) goto bad12;
+	if ((w != 2) && (w != 4)) goto bad12;
+	sumloc = reconst_24(&msg->data[2]);
+	xorloc = reconst_24(&msg->data[5]);
+	if ((sumloc | xorloc) & (w - 1)) goto bad12;
+	nrng = (msg->datalen - 8) / 6;
+	for (rng = &msg->data[8]; nrng; nrng--, rng += 6) {
+		u32 len = (rng[3] << 16) | (rng[4] << 8) | rng[5];
+		if ((reconst_24(rng) | len) & (w - 1)) goto bad12;
+	}
+
+	rsppend_arm(SID_CKSUM);
+	nrng = (msg->datalen - 8) / 6;
+	for (rng = &msg->data[8]; nrng; nrng--, rng += 6) {
+		u32 addr = reconst_24(rng);
+		u32 end = addr + ((rng[3] << 16) | (rng[4] << 8) | rng[5]);
+
+		for (; addr < end; addr += w) {
+			u32 val;
+
+			if (!(addr & 0xFFF)) rsppend_poll();
+			if ((addr == sumloc) || (addr == xorloc)) continue;
+			val = cks_read(addr, w);
+			sum += val;
+			xor ^= val;
+		}
+	}
+	rsppend_disarm();
+
+	resp[0] = SID_CKSUM + 0x40;
+	cur = put_be(&resp[1], sum, w);
+	cur = put_be(cur, xor, w);
+	cur = put_be(cur, cks_read(sumloc, w), w);
+	cur = put_be(cur, cks_read(xorloc, w), w);
+	iso_sendpkt(resp, cur - resp);
+	return;
+
+bad12:
+	tx_7F(SID_CKSUM, 0x12);
+	return;
+}
+
+
+/** pattern search : addresses of the first N matches of pattern / mask in a range */
+static void cmd_search(struct iso14230_msg *msg) {
+	//format : <SID_SEARCH> <A2> <A1> <A0> <L2> <L1> <L0> <N> <P0>...<Pk-1> <M0>...<Mk-1>
+	static u8 resp[2 + (3 * SID_SEARCH_MAXN)] XBUF;
+	const u8 *pat = &msg->data[8];
+	const u8 *mask;
+	const u8 *cur;
+	const u8 *end;
+	unsigned plen;
+	unsigned maxn;
+	unsigned nfound = 0;
+
+	if ((msg->datalen < 10) || ((msg->datalen - 8) & 1)) goto bad12;
+	plen = (msg->datalen - 8) / 2;
+	mask = pat + plen;
+	maxn = msg->data[7];
+	if ((maxn == 0) || (maxn > SID_SEARCH_MAXN) || (plen > SID_SEARCH_MAXPAT)) goto bad12;
+
+	cur = (const u8 *) reconst_24(&msg->data[1]);
+	end = cur + ((msg->data[4] << 16) | (msg->data[5] << 8) | msg->data[6]);
+	if ((u32) (end - cur) < plen) goto bad12;
+	end -= plen;	//last possible start
+
+	rsppend_arm(SID_SEARCH);
+	for (; cur <= end; cur++) {
+		unsigned i;
+
+		if (!((u32) cur & 0xFFF)) rsppend_poll();
+		for (i = 0; i < plen; i++) {
+			if ((cur[i] ^ pat[i]) & mask[i]) break;
+		}
+		if (i != plen) continue;
+
+		resp[2 + (3 * nfound)] = (u32) cur >> 16;
+		resp[3 + (3 * nfound)] = (u32) cur >> 8;
+		resp[4 + (3 * nfound)] = (u32) cur & 0xFF;
+		nfound += 1;
+		if (nfound == maxn) break;
+	}
+	rsppend_disarm();
+
+	resp[0] = SID_SEARCH + 0x40;
+	resp[1] = nfound;
+	iso_sendpkt(resp, 2 + (3 * nfound));
+	return;
+
+bad12:
+	tx_7F(SID_SEARCH, 0x12);
+	return;
+}
+
+
+/** scatter read : one response with the contents of several (address, width, count) entries */
+static void cmd_scatter(struct iso14230_msg *msg) {
+	//format : <SID_SCATTER> [<W> <N> <A3> <A2> <A1> <A0>] ...
+	const u8 *ent;
+	u8 *out = &xscratch[1];
+	unsigned max = (ext_ok || tport->segmented) ? sizeof(xscratch) : (DUMP_MAXPKT + 1);
+	unsigned left;
+
+	left = msg->datalen - 1;
+	if ((left == 0) || (left % 6)) goto bad12;
+
+	for (ent = &msg->data[1]; left; left -= 6, ent += 6) {
+		unsigned w = ent[0];
+		unsigned n = ent[1];
+		u32 addr = ((u32) ent[2] << 24) | (ent[3] << 16) | (ent[4] << 8) | ent[5];
+
+		if ((w != 1) && (w != 2) && (w != 4)) goto bad12;
+		if ((n == 0) || (addr & (w - 1))) goto bad12;	//misaligned : address error
+		if ((unsigned) (out - xscratch) + (w * n) > max) goto bad12;
+
+		for (; n; n--, addr += w) {
+			u32 val;
+
+			switch (w) {
+			case 1:
+				*out++ = *(volatile const u8 *) addr;
+				continue;
+			case 2:
+				val = *(volatile const u16 *) addr;
+				break;
+			default:
+				val = *(volatile const u32 *) addr;
+				*out++ = val >> 24;
+				*out++ = val >> 16;
+				break;
+			}
+			*out++ = val >> 8;
+			*out++ = val & 0xFF;
+		}
+	}
+
+	xscratch[0] = SID_SCATTER + 0x40;
+	iso_sendpkt(xscratch, out - xscratch);
+	return;
+
+bad12:
+	tx_7F(SID_SCATTER, 0x12);
+	return;
+}
+
+
+/** streaming dump : answer, then send up to ds_win blocks as a raw stream */
+static void cmd_dstream(struct iso14230_msg *msg) {
+	u8 resp[4];
+	u16 seq;
+	unsigned n;
+
+	if (tport->segmented) {
+		//needs a raw byte stream
+		tx_7F(SID_DSTREAM, 0x22);
+		return;
+	}
+
+	if ((msg->datalen == 11) && (msg->data[1] == SID_DSTREAM_START)) {
+		//<SID_DSTREAM> <SID_DSTREAM_START> <A2> <A1> <A0> <L2> <L1> <L0> <BH> <BL> <W>
+		u32 len = (msg->data[5] << 16) | (msg->data[6] << 8) | msg->data[7];
+		u32 blk = (msg->data[8] << 8) | msg->data[9];
+		u32 nblk;
+
+		if ((len == 0) || (blk < 16) || (blk > 4096) || (msg->data[10] == 0)) goto bad12;
+		nblk = (len + blk - 1) / blk;
+		if (nblk > 0xFFFF) goto bad12;
+		ds_addr = reconst_24(&msg->data[2]);
+		ds_len = len;
+		ds_blk = blk;
+		ds_nblk = nblk;
+		ds_win = msg->data[10];
+		seq = 0;
+	} else if ((msg->datalen == 4) && (msg->data[1] == SID_DSTREAM_CONT)) {
+		//<SID_DSTREAM> <SID_DSTREAM_CONT> <SEQH> <SEQL>
+		if (!ds_blk) {
+			tx_7F(SID_DSTREAM, 0x22);
+			return;
+		}
+		seq = (msg->data[2] << 8) | msg->data[3];
+	} else {
+		goto bad12;
+	}
+
+	resp[0] = SID_DSTREAM + 0x40;
+	resp[1] = ds_nblk >> 8;
+	resp[2] = ds_nblk & 0xFF;
+	iso_sendpkt(resp, 3);
+
+	for (n = 0; (n < ds_win) && (seq < ds_nblk); n++, seq++) {
+		u32 off = (u32) seq * ds_blk;
+		const u8 *src = (const u8 *) (ds_addr + off);
+		u32 len = ds_len - off;
+		u16 crc;
+
+		if (len > ds_blk) len = ds_blk;
+		resp[0] = seq >> 8;
+		resp[1] = seq & 0xFF;
+		crc = crc16(src, len);
+		crc = crc16_update(crc, resp, 2);
+		resp[2] = crc >> 8;
+		resp[3] = crc & 0xFF;
+		sci_txqueue(src, len);
+		sci_txqueue(resp, 4);
+	}
+	t_lastframe = get_mclk_ts();	//session timeout counts from the end of the stream
+	return;
+
+bad12:
+	tx_7F(SID_DSTREAM, 0x12);
+	return;
+}
+
+
+/** incremental dump : send only the chunks whose crc16 differs from the host's copy */
+static void cmd_diffdump(struct iso14230_msg *msg) {
+	u8 ph[4];
+	const u8 *hcrc = &msg->data[6];
+	u32 addr;
+	u32 csize;
+	unsigned nchunks;
+	int maxpkt;
+	u16 ndiff = 0;
+
+	//<SID_DIFFDUMP> <A2> <A1> <A0> <CSH> <CSL> <CRC0H> <CRC0L> ...
+	if ((msg->datalen < 8) || (msg->datalen & 1)) goto bad12;
+	csize = (msg->data[4] << 8) | msg->data[5];
+	if ((csize < 32) || (csize > 4096)) goto bad12;
+	addr = reconst_24(&msg->data[1]);
+	nchunks = (msg->datalen - 6) / 2;
+
+	ph[0] = SID_DIFFDUMP + 0x40;
+	maxpkt = dump_maxpkt(4, 1);
+
+	rsppend_arm(SID_DIFFDUMP);
+	for (; nchunks; nchunks--, hcrc += 2, addr += csize) {
+		u32 cur;
+		u32 left;
+
+		rsppend_poll();
+		if (crc16((const u8 *) addr, csize) == ((hcrc[0] << 8) | hcrc[1])) continue;
+
+		rsppend_disarm();
+		for (cur = addr, left = csize; left; ) {
+			u32 pktlen = left;
+
+			if (pktlen > (u32) maxpkt) pktlen = maxpkt;
+			ph[1] = cur >> 16;
+			ph[2] = cur >> 8;
+			ph[3] = cur & 0xFF;
+			iso_sendbulk(ph, 4, (const u8 *) cur, pktlen);	//straight from ROM
+			cur += pktlen;
+			left -= pktlen;
+		}
+		ndiff += 1;
+		rsppend_arm(SID_DIFFDUMP);
+	}
+	rsppend_disarm();
+
+	ph[1] = ndiff >> 8;
+	ph[2] = ndiff & 0xFF;
+	iso_sendpkt(ph, 3);
+	return;
+
+bad12:
+	tx_7F(SID_DIFFDUMP, 0x12);
 	return;
 }
 
@@ -593,31 +1900,37 @@ bad12:
 /* WriteMemByAddr - RAM only */
 static void cmd_wmba(struct iso14230_msg *msg) {
 	/* WriteMemByAddress (RAM only !) . format : <SID_WMBA> <AH> <AM> <AL> <SIZ> <DATA> , siz <= 250. */
+	/* in an extended frame, siz = 0 means "rest of frame" */
 	/* response : <SID + 0x40> <AH> <AM> <AL> */
 	u8 rv = 0x12;
 	u32 addr;
-	u8 siz;
+	unsigned siz;
 	u8 *src;
 
 	if (msg->datalen < 6) goto badexit;
 	siz = msg->data[4];
+	if ((siz == 0) && msg->ext) {
+		siz = msg->datalen - 5;
+	}
 
 	if (	(siz == 0) ||
-		(siz > 250) ||
-		(msg->datalen != (siz + 5))) goto badexit;
+		(siz > (EXT_MAXDATA - 5)) ||
+		(msg->datalen != (int) (siz + 5))) goto badexit;
 
 	addr = reconst_24(&msg->data[1]);
 
 	// bounds check, restrict to RAM
 	if (	(addr < RAM_MIN) ||
-		(addr > RAM_MAX)) {
+		((addr + siz - 1) > RAM_MAX)) {
 		rv = 0x42;
 		goto badexit;
 	}
 
-	/* write */
-	src = &msg->data[5];
-	memcpy((void *) addr, src, siz);
+	/* write, unless already streamed there */
+	if (!msg->sdst) {
+		src = &msg->data[5];
+		memcpy((void *) addr, src, siz);
+	}
 
 	msg->data[0] = SID_WMBA + 0x40;	//cheat !
 	iso_sendpkt(msg->data, 4);
@@ -628,6 +1941,184 @@ badexit:
 	return;
 }
 
+/** true if [addr, addr + len) is in RAM, and clear of the kernel itself (incl. stack) and its buffers */
+static bool batch_ramok(u32 addr, u32 len) {
+	if ((addr < RAM_MIN) || (len == 0) || ((addr + len - 1) > RAM_MAX)) return 0;
+	if ((addr <= KERNEL_END) && ((addr + len - 1) >= KERNEL_START)) return 0;
+	if ((addr < (BIGBUF_START + BIGBUF_SIZE)) && ((addr + len) > BIGBUF_START)) return 0;
+	if ((addr < (XBUF_START + XBUF_SIZE)) && ((addr + len) > XBUF_START)) return 0;
+	return 1;
+}
+
+/** run one batch sub-request.
+ * @param op : points to the sub-request; *oplen is set to its length, or to left if it's truncated / unknown
+ * @return 0 if ok, NRC otherwise
+ */
+static u32 batch_op(const u8 *op, unsigned left, unsigned *oplen) {
+	u32 addr, src, len;
+	u32 rv;
+	u16 val;
+
+	*oplen = left;
+	switch (op[0]) {
+	case SID_BATCH_EB:
+		//<SID_BATCH_EB> <BLOCK #>
+		if (left < 2) return 0x12;
+		*oplen = 2;
+		if (flashstate != FL_READY) return 0x22;
+		if (flpage_fill) return PFWB_PENDING;
+		fl_stagereset();
+		rv = platf_flash_eb(op[1]);
+		break;
+	case SID_BATCH_WRAM:
+		//<SID_BATCH_WRAM> <A2> <A1> <A0> <N> <D0>...<D(N-1)>
+		if (left < 5) return 0x12;
+		len = op[4];
+		if (left < (5 + len)) return 0x12;
+		*oplen = 5 + len;
+		addr = reconst_24(&op[1]);
+		if (!batch_ramok(addr, len)) return 0x42;
+		memcpy((void *) addr, &op[5], len);
+		return 0;
+	case SID_BATCH_WFL:
+		//<SID_BATCH_WFL> <FA2> <FA1> <FA0> <RA2> <RA1> <RA0> <NH> <NL>
+		if (left < 9) return 0x12;
+		*oplen = 9;
+		if (flashstate != FL_READY) return 0x22;
+		addr = reconst_24(&op[1]);
+		src = reconst_24(&op[4]);
+		len = (op[7] << 8) | op[8];
+		if (!batch_ramok(src, len)) return 0x42;
+		rv = fl_stage(addr, (const u8 *) src, len);
+		break;
+	case SID_BATCH_CRC:
+		//<SID_BATCH_CRC> <A2> <A1> <A0> <L2> <L1> <L0> <CRCH> <CRCL>
+		if (left < 9) return 0x12;
+		*oplen = 9;
+		addr = reconst_24(&op[1]);
+		len = get_be(&op[4], 3);
+		if (crc16((const u8 *) addr, len) != ((op[7] << 8) | op[8])) return 0x77;	//crcerror
+		return 0;
+	case SID_BATCH_EEW:
+		//<SID_BATCH_EEW> <AH> <AL> <DH> <DL>
+		if (left < 5) return 0x12;
+		*oplen = 5;
+		val = (op[3] << 8) | op[4];
+		eep_write16((op[1] << 8) | op[2], &val);
+		return 0;
+	default:
+		return 0x12;
+	}
+
+	if (rv) {
+		rv = (rv & 0xFF) | 0x80;	//make sure it's a valid extented NRC
+	}
+	return rv;
+}
+
+/* run sub-requests in order, stop at the first failure.
+ * response : <SID_BATCH + 0x40> <N> <status 1>...<status N>
+ */
+static void cmd_batch(struct iso14230_msg *msg) {
+	u8 resp[2 + SID_BATCH_MAXOPS + 1];
+	unsigned pos = 1;
+	unsigned n = 0;
+	unsigned oplen;
+	u32 rv = 0;
+
+	if (msg->datalen < 2) {
+		tx_7F(SID_BATCH, 0x12);
+		return;
+	}
+
+	rsppend_arm(SID_BATCH);
+	while ((pos < (unsigned) msg->datalen) && !rv) {
+		if (n == SID_BATCH_MAXOPS) {
+			rv = 0x12;	//too many
+			oplen = 0;
+		} else {
+			rv = batch_op(&msg->data[pos], msg->datalen - pos, &oplen);
+			rsppend_poll();
+		}
+		resp[2 + n] = rv;
+		n += 1;
+		pos += oplen;
+	}
+	rsppend_disarm();
+
+	resp[0] = SID_BATCH + 0x40;
+	resp[1] = n;
+	iso_sendpkt(resp, 2 + n);
+	return;
+}
+
+
+/* SID_CONF_CAPS descriptor; see iso_cmds.h for the layout */
+static const u8 caps_sids[] = {0x81, SID_RECUID, SID_RMBA, SID_WMBA, SID_TP, SID_EEPROM, SID_FLASH,
+				SID_DUMP, SID_CONF, SID_FLREQ, SID_RESET, SID_ATP, SID_BATCH, SID_DSTREAM, SID_DIFFDUMP, SID_SCATTER, SID_SEARCH, SID_CKSUM, SID_HASHMAP, SID_SHA256};
+static const u8 caps_flsubs[] = {SIDFL_EB, SIDFL_WB, SIDFL_WWOPEN, SIDFL_WWDATA, SIDFL_WWSTAT, SIDFL_FLUSH, SIDFL_UNPROTECT};
+
+static void cmd_caps(void) {
+	u8 *buf = xscratch;	//3 + 2 + 8 + 6 + 2 + 3 + 3 + 1 + sizeof(caps_sids) + 2 + 1 + sizeof(caps_flsubs) + 1 + (3 * (PF_NUMBLOCKS + 1)) + 6
+	u8 *cur = buf;
+	u16 features = CAPS_F_FEC | CAPS_F_EXTFRAME | CAPS_F_WWRITE | CAPS_F_DUMPSEQ | CAPS_F_RSPPEND | CAPS_F_DUMPLZ;
+	u16 confsubs = ((2u << SID_CONF_CAPS) - 2) & ~(1 << SID_CONF_R16);	//bits 1 to SID_CONF_CAPS
+	unsigned i;
+
+#ifdef POSTERASE_VERIFY
+	features |= CAPS_F_PEVERIFY;
+#endif
+#ifdef DIAG_U16READ
+	features |= CAPS_F_U16READ;
+	confsubs |= 1 << SID_CONF_R16;
+#endif
+#ifdef CAN_TRANSPORT
+	if (can_isup()) {
+		features |= CAPS_F_CAN;
+		confsubs |= 1 << SID_CONF_CANTP;
+	}
+#endif
+
+	*cur++ = SID_CONF + 0x40;
+	*cur++ = CAPS_VERSION;
+#if defined(SH7058)
+	*cur++ = CAPS_PLATF_7058;
+#elif defined(SH7055_18)
+	*cur++ = CAPS_PLATF_7055_18;
+#else
+	*cur++ = CAPS_PLATF_7055_35;
+#endif
+	cur = put_be(cur, features, 2);
+	cur = put_be(cur, RAM_MIN, 4);
+	cur = put_be(cur, RAM_MAX, 4);
+	cur = put_be(cur, BIGBUF_START, 4);
+	cur = put_be(cur, BIGBUF_SIZE, 2);
+	cur = put_be(cur, SIDFL_WB_DLEN, 2);	//page / staging buffer size
+	*cur++ = WW_WINDOW;
+	cur = put_be(cur, EXT_MAXDATA, 2);
+	*cur++ = FEC_MAXDEPTH;
+	*cur++ = SCI_DEFAULTDIV;
+	*cur++ = brr_cur;
+
+	*cur++ = sizeof(caps_sids);
+	memcpy(cur, caps_sids, sizeof(caps_sids));
+	cur += sizeof(caps_sids);
+	cur = put_be(cur, confsubs, 2);
+	*cur++ = sizeof(caps_flsubs);
+	memcpy(cur, caps_flsubs, sizeof(caps_flsubs));
+	cur += sizeof(caps_flsubs);
+
+	*cur++ = PF_NUMBLOCKS;
+	for (i = 0; i <= PF_NUMBLOCKS; i++) {
+		cur = put_be(cur, fblocks[i], 3);
+	}
+	cur = put_be(cur, XBUF_START, 4);
+	cur = put_be(cur, XBUF_SIZE, 2);
+
+	iso_sendpkt(buf, cur - buf);
+	return;
+}
+
 /* set & configure kernel */
 static void cmd_conf(struct iso14230_msg *msg) {
 	u8 resp[4];
@@ -660,6 +2151,120 @@ static void cmd_conf(struct iso14230_msg *msg) {
 		iso_sendpkt(resp, 1);
 		return;
 		break;
+	case SID_CONF_TRYSPEED:
+		/* <SID_CONF> <SID_CONF_TRYSPEED> <new divisor> ; responds at the old speed */
+		if (msg->datalen != 3) goto bad12;
+		iso_sendpkt(resp, 1);
+		sci_setbrr(msg->data[2]);
+		speed_trying = 1;
+		speed_nego = 1;
+		t_trystart = get_mclk_ts();
+		probe_lineerr = 0;
+		probe_badframes = 0;
+		return;
+		break;
+	case SID_CONF_PROBE:
+		/* <SID_CONF> <SID_CONF_PROBE> <pattern...>
+		 * response : <SID_CONF + 0x40> <line errors> <bad frames> <pattern...>
+		 */
+		if (msg->datalen > 254) goto bad12;
+		memmove(&msg->data[3], &msg->data[2], msg->datalen - 2);
+		msg->data[0] = SID_CONF + 0x40;	//cheat !
+		msg->data[1] = probe_lineerr;
+		msg->data[2] = probe_badframes;
+		iso_sendpkt(msg->data, msg->datalen + 1);
+		return;
+		break;
+	case SID_CONF_COMMIT:
+		/* <SID_CONF> <SID_CONF_COMMIT> <~SID_CONF_COMMIT> */
+		if ((msg->datalen != 3) || (msg->data[2] != (u8) ~SID_CONF_COMMIT)) goto bad12;
+		if (!speed_trying) {
+			tx_7F(SID_CONF, 0x22);
+			return;
+		}
+		speed_trying = 0;
+		if (brr_cur != brr_ok) {
+			brr_fallback = brr_ok;
+			brr_ok = brr_cur;
+		}
+		lq_winframes = 0;
+		lq_winbad = 0;
+		iso_sendpkt(resp, 1);
+		return;
+		break;
+	case SID_CONF_STATS:
+		/* <SID_CONF> <SID_CONF_STATS> <reset> */
+		{
+		u8 sbuf[11];
+		sbuf[0] = SID_CONF + 0x40;
+		sbuf[1] = sstats.goodframes >> 8;
+		sbuf[2] = sstats.goodframes & 0xFF;
+		sbuf[3] = sstats.badframes >> 8;
+		sbuf[4] = sstats.badframes & 0xFF;
+		sbuf[5] = sstats.lineerrs >> 8;
+		sbuf[6] = sstats.lineerrs & 0xFF;
+		sbuf[7] = sstats.nrcs >> 8;
+		sbuf[8] = sstats.nrcs & 0xFF;
+		sbuf[9] = sstats.fecfixes >> 8;
+		sbuf[10] = sstats.fecfixes & 0xFF;
+		iso_sendpkt(sbuf, 11);
+		if (msg->data[2]) {
+			memset(&sstats, 0, sizeof(sstats));
+		}
+		return;
+		break;
+		}
+	case SID_CONF_DUMPLEN:
+		/* <SID_CONF> <SID_CONF_DUMPLEN> <bytes per packet> , or 16-bit <LH> <LL> for extended frames */
+		if (msg->datalen == 4) {
+			tmp = (msg->data[2] << 8) | msg->data[3];
+			if (tmp > DUMP_MAXEXT) goto bad12;
+		} else {
+			tmp = msg->data[2];
+			if (tmp > DUMP_MAXPKT) goto bad12;
+		}
+		if ((tmp < 2) || (tmp & 1)) goto bad12;
+		dump_pktlen = tmp;
+		iso_sendpkt(resp, 1);
+		return;
+		break;
+	case SID_CONF_CAPS:
+		/* <SID_CONF> <SID_CONF_CAPS> <0> */
+		if ((msg->datalen != 3) || msg->data[2]) goto bad12;
+		cmd_caps();
+		return;
+		break;
+	case SID_CONF_EXTFRAME:
+		/* <SID_CONF> <SID_CONF_EXTFRAME> <enable> ; response : <SID_CONF + 0x40> <MAXH> <MAXL> */
+		resp[1] = EXT_MAXDATA >> 8;
+		resp[2] = EXT_MAXDATA & 0xFF;
+		iso_sendpkt(resp, 3);
+		ext_ok = (msg->data[2] != 0);
+		return;
+		break;
+	case SID_CONF_FEC:
+		/* <SID_CONF> <SID_CONF_FEC> <depth> */
+		if (msg->data[2] > FEC_MAXDEPTH) goto bad12;
+		iso_sendpkt(resp, 1);
+		fec_depth = msg->data[2];
+		return;
+		break;
+#ifdef CAN_TRANSPORT
+	case SID_CONF_CANTP:
+		/* <SID_CONF> <SID_CONF_CANTP> <BS> <STmin> */
+		if (msg->datalen != 4) goto bad12;
+		iso_sendpkt(resp, 1);
+		can_setfc(msg->data[2], msg->data[3]);
+		return;
+		break;
+#endif
+	case SID_CONF_SESSMODE:
+		/* <SID_CONF> <SID_CONF_SESSMODE> <mode> */
+		if ((msg->datalen != 3) || (msg->data[2] > 1)) goto bad12;
+		sess_keep = msg->data[2];
+		iso_sendpkt(resp, 1);
+		return;
+		break;
 	case SID_CONF_CKS1:
 		//<SID_CONF> <SID_CONF_CKS1> <CNH> <CNL> <CRC0H> <CRC0L> ...<CRC3H> <CRC3L>
 		if (msg->datalen != 12) {
@@ -698,6 +2303,167 @@ bad12:
 }
 
 
+/* SID 83 handler, see atp_* above */
+static void cmd_atp(struct iso14230_msg *msg) {
+	u8 resp[2 + ATP_NUM];
+	const u8 *tp;
+	unsigned resplen = 2;
+
+	if (msg->datalen < 2) goto bad12;
+
+	resp[0] = SID_ATP + 0x40;
+	resp[1] = msg->data[1];
+
+	switch (msg->data[1]) {
+	case SID_ATP_READLIMITS:
+	case SID_ATP_READCUR:
+		if (msg->datalen != 2) goto bad12;
+		tp = (msg->data[1] == SID_ATP_READLIMITS) ? atp_limits : atp_cur;
+		memcpy(&resp[2], tp, ATP_NUM);
+		resplen += ATP_NUM;
+		break;
+	case SID_ATP_SETDEFAULT:
+		if (msg->datalen != 2) goto bad12;
+		atp_apply(atp_defaults);
+		break;
+	case SID_ATP_SET:
+		if (msg->datalen != (2 + ATP_NUM)) goto bad12;
+		tp = &msg->data[2];
+		if ((tp[ATP_P3MAX] == 0) || (tp[ATP_P3MAX] > atp_limits[ATP_P3MAX])) {
+			tx_7F(SID_ATP, 0x31);	//requestOutOfRange
+			return;
+		}
+		atp_apply(tp);
+		break;
+	default:
+		goto bad12;
+	}
+
+	iso_sendpkt(resp, resplen);
+	return;
+
+bad12:
+	tx_7F(SID_ATP, 0x12);
+	return;
+}
+
+/** handle a complete request */
+static void cmd_dispatch(struct iso14230_msg *msg) {
+	u8 txbuf[1];
+
+	switch (cmstate) {
+	case CM_IDLE:
+		/* accept only startcomm requests */
+		if (msg->data[0] == 0x81) {
+			cmd_startcomm();
+			cmstate = CM_READY;
+		}
+		iso_clearmsg(msg);
+		break;
+
+	case CM_READY:
+		switch (msg->data[0]) {
+		case 0x81:
+			cmd_startcomm();
+			iso_clearmsg(msg);
+			break;
+		case SID_RECUID:
+			iso_sendpkt(npk_ver_string, sizeof(npk_ver_string));
+			iso_clearmsg(msg);
+			break;
+		case SID_CONF:
+			cmd_conf(msg);
+			iso_clearmsg(msg);
+			break;
+		case SID_RESET:
+			/* ECUReset */
+			txbuf[0] = msg->data[0] + 0x40;
+			iso_sendpkt(txbuf, 1);
+			sci_txwait();
+#ifdef CAN_TRANSPORT
+			can_txwait();
+#endif
+			die();
+			break;
+		case SID_RMBA:
+			cmd_rmba(msg);
+			iso_clearmsg(msg);
+			break;
+		case SID_WMBA:
+			cmd_wmba(msg);
+			iso_clearmsg(msg);
+			break;
+		case SID_DUMP:
+			cmd_dump(msg);
+			iso_clearmsg(msg);
+			break;
+		case SID_FLASH:
+			cmd_flash_utils(msg);
+			iso_clearmsg(msg);
+			break;
+		case SID_TP:
+			txbuf[0] = msg->data[0] + 0x40;
+			iso_sendpkt(txbuf, 1);
+			iso_clearmsg(msg);
+			break;
+		case SID_ATP:
+			cmd_atp(msg);
+			iso_clearmsg(msg);
+			break;
+		case SID_FLREQ:
+			cmd_flash_init();
+			iso_clearmsg(msg);
+			break;
+		case SID_EEPROM:
+			cmd_ee(msg);
+			iso_clearmsg(msg);
+			break;
+		case SID_BATCH:
+			cmd_batch(msg);
+			iso_clearmsg(msg);
+			break;
+		case SID_DSTREAM:
+			cmd_dstream(msg);
+			iso_clearmsg(msg);
+			break;
+		case SID_DIFFDUMP:
+			cmd_diffdump(msg);
+			iso_clearmsg(msg);
+			break;
+		case SID_SCATTER:
+			cmd_scatter(msg);
+			iso_clearmsg(msg);
+			break;
+		case SID_SEARCH:
+			cmd_search(msg);
+			iso_clearmsg(msg);
+			break;
+		case SID_CKSUM:
+			cmd_cksum(msg);
+			iso_clearmsg(msg);
+			break;
+		case SID_HASHMAP:
+			cmd_hashmap(msg);
+			iso_clearmsg(msg);
+			break;
+		case SID_SHA256:
+			cmd_sha256(msg);
+			iso_clearmsg(msg);
+			break;
+		default:
+			tx_7F(msg->data[0], 0x11);
+			iso_clearmsg(msg);
+			break;
+		}	//switch (SID)
+		break;
+	default :
+		//invalid state, or nothing special to do
+		break;
+	}	//switch (cmstate)
+	return;
+}
+
+
 /* command parser; infinite loop waiting for commands.
  * not sure if it's worth the trouble to make this async,
  * what other tasks could run in background ? reflash shit ?
@@ -706,116 +2472,135 @@ bad12:
  */
 void cmd_loop(void) {
 	u8 rxbyte;
-	u8 txbuf[63];
 
-	struct iso14230_msg msg;
-
-	//u32 t_last, t_cur;	//timestamps
+	static struct iso14230_msg msg BIGBUF;
 
 	iso_clearmsg(&msg);
 
 	while (1) {
 		enum iso_prc prv;
+		u16 rxent;
+
+#ifdef CAN_TRANSPORT
+		{
+			unsigned canlen = can_poll(msg.data, EXT_MAXDATA);
+
+			if (canlen || can_rxbusy()) {
+				/* a CAN request is reassembled in msg.data : drop the K-line frame in progress, and
+				 * ignore K-line input (bytes and line errors) meanwhile, it would corrupt the request */
+				iso_clearmsg(&msg);
+				rx_histdrop(rxh_len);
+				rx_resyncing = 0;
+				rx_draining = 0;
+				while (sci_rxget(&rxent)) {}
+			}
+			if (canlen) {
+				msg.datalen = canlen;
+				msg.ext = 1;	//no 255-byte limit, no FEC
+				t_lastframe = get_mclk_ts();
+				SAT_INC16(sstats.goodframes);
+				tport = &tp_can;
+				cmd_dispatch(&msg);
+				iso_clearmsg(&msg);
+				continue;
+			}
+			if (can_rxbusy()) {
+				continue;
+			}
+		}
+#endif
 
-		/* in case of errors (ORER | FER | PER), reset state mach. */
-		if (SCI1.SSR.BYTE & 0x38) {
+		if (!rx_nextbyte(&rxent)) {
+			speed_poll();
+			if ((sess_keep || speed_nego) && (cmstate != CM_IDLE) &&
+				((get_mclk_ts() - t_lastframe) >= sess_ticks)) {
+				/* session timeout */
+				cmstate = CM_IDLE;
+				flashstate = FL_IDLE;
+			}
+			continue;
+		}
 
-			cmstate = CM_IDLE;
-			flashstate = FL_IDLE;
+		/* in case of errors (ORER | FER | PER), reset state mach. unless asked to keep it, or
+		 * while negotiating speed : trial speeds and fallbacks are expected to cause some.
+		 * Noise on K-line doesn't end a session driven over CAN either.
+		 * The frame in progress is broken : forget it, and restart parsing at this byte.
+		 */
+		if (rxent & RXF_ERR) {
+			rx_resyncing = 0;
+			rx_draining = 0;
+			cnt_bad(1);
+			if (!sess_keep && !speed_nego && (tport == &tp_kline)) {
+				cmstate = CM_IDLE;
+				flashstate = FL_IDLE;
+			}
 			iso_clearmsg(&msg);
-			sci_rxidle(MAX_INTERBYTE);
+			rx_histdrop(rxh_len - 1);
 			continue;
 		}
 
-		if (!SCI1.SSR.BIT.RDRF) continue;
+		/* interbyte timeout : abandon the partial frame, this byte starts a new one */
+		if (rxent & RXF_GAP) {
+			rx_draining = 0;
+			rxh_badend = 0;
+			if (rxh_len > 1) {
+				if (!rx_resyncing) cnt_bad(0);
+				rx_resyncing = 0;
+				iso_clearmsg(&msg);
+				rx_histdrop(rxh_len - 1);
+				continue;
+			}
+		}
 
-		rxbyte = SCI1.RDR;
-		SCI1.SSR.BIT.RDRF = 0;
+		if (rx_draining) {
+			rx_histdrop(rxh_len);
+			continue;
+		}
 
-		//t_cur = get_mclk_ts();	/* XXX TODO : filter out interrupted messages with t>5ms interbyte ? */
+		rxbyte = (u8) rxent;
 
 		/* got a byte; parse according to state */
 		prv = iso_parserx(&msg, rxbyte);
+		if (fec_depth && !msg.ext && (msg.di == (msg.datalen + 1))) {
+			prv = fec_rxframe(&msg, prv);
+		}
+		/* not while re-parsing history (rxh_pos < rxh_len) : those bytes may have been streamed already,
+		 * as part of a rejected frame */
+		if ((prv == ISO_PRC_NEEDMORE) && (msg.di == 5) && !msg.sdst &&
+			!fec_depth && !rx_resyncing && (rxh_pos == rxh_len)) {
+			rx_streamsetup(&msg);
+		}
 
 		if (prv == ISO_PRC_NEEDMORE) {
 			continue;
 		}
 		if (prv != ISO_PRC_DONE) {
+			/* resync : retry starting at the next byte */
+			if (!rx_resyncing) {
+				rx_resyncing = 1;
+				cnt_bad(0);
+			}
 			iso_clearmsg(&msg);
-			sci_rxidle(MAX_INTERBYTE);
+			if (rxh_pos > rxh_badend) rxh_badend = rxh_pos;
+			rx_histdrop(1);
 			continue;
 		}
-		/* here, we have a complete iso frame */
-
-		switch (cmstate) {
-		case CM_IDLE:
-			/* accept only startcomm requests */
-			if (msg.data[0] == 0x81) {
-				cmd_startcomm();
-				cmstate = CM_READY;
-			}
+		if (rxh_badend && ((rxh_pos != rxh_len) || (rx_tail != rx_head))) {
+			/* starts inside a rejected frame, and isn't the last thing received : could be a phantom */
 			iso_clearmsg(&msg);
-			break;
-
-		case CM_READY:
-			switch (msg.data[0]) {
-			case 0x81:
-				cmd_startcomm();
-				iso_clearmsg(&msg);
-				break;
-			case SID_RECUID:
-				iso_sendpkt(npk_ver_string, sizeof(npk_ver_string));
-				iso_clearmsg(&msg);
-				break;
-			case SID_CONF:
-				cmd_conf(&msg);
-				iso_clearmsg(&msg);
-				break;
-			case SID_RESET:
-				/* ECUReset */
-				txbuf[0] = msg.data[0] + 0x40;
-				iso_sendpkt(txbuf, 1);
-				die();
-				break;
-			case SID_RMBA:
-				cmd_rmba(&msg);
-				iso_clearmsg(&msg);
-				break;
-			case SID_WMBA:
-				cmd_wmba(&msg);
-				iso_clearmsg(&msg);
-				break;
-			case SID_DUMP:
-				cmd_dump(&msg);
-				iso_clearmsg(&msg);
-				break;
-			case SID_FLASH:
-				cmd_flash_utils(&msg);
-				iso_clearmsg(&msg);
-				break;
-			case SID_TP:
-				txbuf[0] = msg.data[0] + 0x40;
-				iso_sendpkt(txbuf, 1);
-				iso_clearmsg(&msg);
-				break;
-			case SID_FLREQ:
-				cmd_flash_init();
-				iso_clearmsg(&msg);
-				break;
-			case SID_EEPROM:
-				cmd_ee(&msg);
-				iso_clearmsg(&msg);
-				break;
-			default:
-				tx_7F(msg.data[0], 0x11);
-				iso_clearmsg(&msg);
-				break;
-			}	//switch (SID)
-			break;
-		default :
-			//invalid state, or nothing special to do
-			break;
-		}	//switch (cmstate)
+			rx_histdrop(rxh_len);
+			rx_draining = 1;
+			continue;
+		}
+		/* here, we have a complete iso frame */
+		rx_histdrop(rxh_pos);
+		t_lastframe = get_mclk_ts();
+		rx_resyncing = 0;
+		SAT_INC16(sstats.goodframes);
+		lq_event(0);
+
+		tport = &tp_kline;
+		cmd_dispatch(&msg);
 	}	//while 1
 
 	die();
@@ -1,3 +1,5 @@
+#ifndef _CMD_PARSER_H
+#define _CMD_PARSER_H
 /* stuff for receiving commands etc */
 
 /* (c) copyright fenugrec 2016
@@ -17,6 +19,16 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include "stypes.h"
+
+/* one part of a response, sent from where it is; see iso_sendsg() */
+struct tx_seg {
+	const u8 *p;
+	unsigned len;
+};
+
 void cmd_init(u8 brrdiv);
 
-void cmd_loop(void);
\ No newline at end of file
+void cmd_loop(void);
+
+#endif
@@ -4,6 +4,7 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include "stypes.h"
+#include "platf.h"	//XBUF
 
 //#define CRC16	0xC86C	//"baicheva00"
 #define CRC16	0xBAAD	//koopman, 2048bits (256B)
@@ -14,7 +15,7 @@
  * https://www.lammertbies.nl/comm/info/crc-calculation.html
  */
 static bool crc_tab16_init = 0;
-static u16 crc_tab16[256];
+static u16 crc_tab16[256] XBUF;
 
 static void init_crc16_tab( void ) {
 	u32 i, j;
@@ -37,14 +38,11 @@ static void init_crc16_tab( void ) {
 }  /* init_crc16_tab */
 
 
-/* 12 cy/byte; codesize = 0x78; tablesiz = 512B */
-u16 crc16(const u8 *data, u32 siz) {
-	u16 crc;
-
+/* continue a CRC16 over more data : crc16(a+b) == crc16_update(crc16(a), b)
+ * 12 cy/byte; codesize = 0x78; tablesiz = 512B */
+u16 crc16_update(u16 crc, const u8 *data, u32 siz) {
 	if ( ! crc_tab16_init ) init_crc16_tab();
 
-	crc = 0;
-
 	while (siz > 0) {
 		u16 tmp;
 		u8 nextval;
@@ -65,3 +63,28 @@ u16 crc16(const u8 *data, u32 siz) {
 
 	return crc;
 }
+
+u16 crc16(const u8 *data, u32 siz) {
+	return crc16_update(0, data, siz);
+}
+
+
+/*** CRC32 (IEEE 802.3 reflected, same as zlib crc32()), 4 bits at a time :
+ * the table is only 64B, in ROM; about 2x the cycles of crc16_update()
+ */
+static const u32 crc_tab32[16] = {
+	0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+	0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+};
+
+/* continue a CRC32 over more data; start with crc = 0 */
+u32 crc32_update(u32 crc, const u8 *data, u32 siz) {
+	crc = ~crc;
+	while (siz > 0) {
+		crc ^= *data++;
+		crc = (crc >> 4) ^ crc_tab32[crc & 0x0F];
+		crc = (crc >> 4) ^ crc_tab32[crc & 0x0F];
+		siz -= 1;
+	}
+	return ~crc;
+}
@@ -4,5 +4,7 @@
 #include "stypes.h"
 
 u16 crc16(const u8 *data, u32 siz);
+u16 crc16_update(u16 crc, const u8 *data, u32 siz);
+u32 crc32_update(u32 crc, const u8 *data, u32 siz);
 
 #endif
@@ -0,0 +1,99 @@
+/* Forward error correction for bulk frames, see SID_CONF_FEC
+ *
+ * Each lane is a Reed-Solomon-like code over GF(2^8) (poly 0x11D), with 2 check symbols :
+ *	P0 = d_0 ^ d_1 ^ ... ^ d_(m-1)
+ *	P1 = sum(d_k * a^(m-k)) , computed by Horner's rule
+ * which is enough to locate and correct one bad byte per lane.
+ * Bytes are interleaved over <depth> lanes (byte i in lane i % depth),
+ * so a burst of up to <depth> consecutive bad bytes is correctable.
+ *
+ * Parity follows the data : <depth> P0 bytes, then <depth> P1 bytes. Each block is rotated so the
+ * interleave carries on past the data (parity byte at frame offset i also belongs to lane i % depth);
+ * a burst straddling the data / parity boundary is therefore still correctable.
+ */
+
+#include <stddef.h>	//NULL
+#include "stypes.h"
+#include "fec.h"
+
+/* multiply by a = 0x02 */
+static u8 gf_mul2(u8 x) {
+	if (x & 0x80) {
+		return (x << 1) ^ 0x1D;
+	}
+	return x << 1;
+}
+
+/* position of a lane's check symbol within each parity block */
+static unsigned fec_ppos(unsigned len, unsigned depth, unsigned lane) {
+	return (lane + depth - (len % depth)) % depth;
+}
+
+/** compute parity of <h> <p>, i.e. data in two parts (plen can be 0) */
+void fec_encode(const u8 *h, unsigned hlen, const u8 *p, unsigned plen, unsigned depth, u8 *parity) {
+	u8 p0[FEC_MAXDEPTH] = {0};
+	u8 p1[FEC_MAXDEPTH] = {0};
+	unsigned i, lane;
+	unsigned len = hlen + plen;
+
+	lane = 0;
+	for (i = 0; i < len; i++) {
+		u8 d = (i < hlen) ? h[i] : p[i - hlen];
+		p0[lane] ^= d;
+		p1[lane] = gf_mul2(p1[lane] ^ d);
+		lane += 1;
+		if (lane == depth) lane = 0;
+	}
+
+	for (lane = 0; lane < depth; lane++) {
+		unsigned pos = fec_ppos(len, depth, lane);
+		parity[pos] = p0[lane];
+		parity[depth + pos] = p1[lane];
+	}
+	return;
+}
+
+/** check + correct data and parity in-place; the 2*depth parity bytes follow data[len - 1].
+ *
+ * @return -1 if uncorrectable, else number of corrected bytes (0 : no error)
+ */
+int fec_correct(u8 *data, unsigned len, unsigned depth) {
+	u8 syn[2 * FEC_MAXDEPTH];
+	u8 *parity = &data[len];
+	unsigned lane;
+	int fixed = 0;
+
+	if ((depth == 0) || (depth > FEC_MAXDEPTH)) return -1;
+
+	fec_encode(data, len, NULL, 0, depth, syn);
+
+	for (lane = 0; lane < depth; lane++) {
+		unsigned pos = fec_ppos(len, depth, lane);
+		u8 s0 = syn[pos] ^ parity[pos];
+		u8 s1 = syn[depth + pos] ^ parity[depth + pos];
+		unsigned m, i;
+		u8 t;
+
+		if ((s0 == 0) && (s1 == 0)) continue;
+
+		fixed += 1;
+		if ((s0 == 0) || (s1 == 0)) {
+			//bad parity byte; data is fine. Repair it too, the frame checksum covers it
+			parity[pos] ^= s0;
+			parity[depth + pos] ^= s1;
+			continue;
+		}
+
+		/* single error e at lane index j : s0 = e, s1 = e * a^(m-j). Find j */
+		m = (len + depth - 1 - lane) / depth;	//# of data bytes in this lane
+		t = s0;
+		for (i = 1; i <= m; i++) {
+			t = gf_mul2(t);
+			if (t == s1) break;
+		}
+		if (i > m) return -1;
+
+		data[((m - i) * depth) + lane] ^= s0;
+	}
+	return fixed;
+}
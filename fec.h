@@ -0,0 +1,11 @@
+#ifndef _FEC_H
+#define _FEC_H
+
+#include "stypes.h"
+
+#define FEC_MAXDEPTH	4	//max interleave depth; parity is 2 * depth bytes
+
+void fec_encode(const u8 *h, unsigned hlen, const u8 *p, unsigned plen, unsigned depth, u8 *parity);
+int fec_correct(u8 *data, unsigned len, unsigned depth);
+
+#endif
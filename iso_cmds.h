@@ -19,6 +19,14 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+/* SID allocation :
+ * - settings and queries about the kernel itself (speed, FEC, frame sizes, stats, capabilities...)
+ *	are SID_CONF subcommands;
+ * - other kernel-specific requests get their own SID, allocated downwards : 0xBA-0xBE (iso14230
+ *	"system supplier specific") is full, so newer ones use 0xB9 and below, from the "vehicle manufacturer
+ *	specific" 0xA0-0xB9. No manufacturer service is reachable while the kernel runs, so these can't clash.
+ */
+
 
 #define SID_RECUID	0x1A	/* readECUID , in this case kernel ID */
 #define SID_RECUID_PRC	"\x5A"	/* positive response code, to be concatenated to version string */
@@ -26,7 +34,47 @@
 #define SID_RMBA 0x23	/* ReadMemByAddress. format : <SID_RMBA> <AH> <AM> <AL> <SIZ>  , siz <= 251. */
 				/* response : <SID + 0x40> <D0>....<Dn> <AH> <AM> <AL> */
 
+#define SID_SCATTER 0xB7	/* scatter read. format : <SID_SCATTER> <entry 1> ... <entry n> ,
+						 * entry : <W> <N> <A3> <A2> <A1> <A0> : N (1-255) elements of W bytes (1, 2 or 4) from <A3..A0>,
+						 * each read with a W-byte access (address must be W-aligned). Peripheral registers are fine.
+						 * response : <SID + 0x40> <data of entry 1> ... <data of entry n> , elements big-endian.
+						 * Total response is at most 255 bytes, or 512 with SID_CONF_EXTFRAME / CAN. */
+
+#define SID_SEARCH 0xB6	/* pattern search. format : <SID_SEARCH> <A2> <A1> <A0> <L2> <L1> <L0> <N> <P0>...<Pk-1> <M0>...<Mk-1>
+						 * finds the first N (1 to SID_SEARCH_MAXN) addresses in the L-byte range at <A2 A1 A0> where
+						 * (byte[i] & Mi) == (Pi & Mi) for the whole k-byte pattern (1 to SID_SEARCH_MAXPAT); M = 0 is a wildcard.
+						 * response : <SID + 0x40> <n> <A2> <A1> <A0> ... (n matches, ascending). To get more, search
+						 * again from the last match + 1. May be preceded by 7F B6 78 (ResponsePending) */
+	#define SID_SEARCH_MAXN	64
+	#define SID_SEARCH_MAXPAT	120
+
+#define SID_CKSUM 0xB5	/* ROM checksum. format : <SID_CKSUM> <W> <SA2> <SA1> <SA0> <XA2> <XA1> <XA0> <range 1> ... <range n>
+						 * range : <A2> <A1> <A0> <L2> <L1> <L0>. Sum and xor of all W-byte (2 or 4) big-endian words
+						 * in the ranges, skipping the stored sum at <SA> and stored xor at <XA>. Everything W-aligned.
+						 * response : <SID + 0x40> <sum> <xor> <stored sum> <stored xor> , each W bytes.
+						 * Nissan "std" checksum : W = 4, one range covering the ROM, SA / XA as found by nisrom.
+						 * May be preceded by 7F B5 78 (ResponsePending) */
+
+#define SID_HASHMAP 0xB4	/* ROM hash map. format : <SID_HASHMAP> <MODE> <A2> <A1> <A0> <C2> <C1> <C0> <NH> <NL> [<crc 0>...<crc N-1>]
+						 * N chunks of C bytes (128 to SID_HASHMAP_MAXCHUNK, i.e. up to the biggest erase block) from <A2 A1 A0>.
+						 * Hash : crc16() (see crc.c), or crc32 (as zlib crc32()) with SID_HASHMAP_CRC32 : 2 or 4 bytes / chunk.
+						 * response : <SID + 0x40> <crc 0>...<crc N-1> , or with SID_HASHMAP_CMP (the request then
+						 * carries the host's crcs) : <SID + 0x40> <bitmap> , bit set = chunk differs; MSB of the
+						 * first byte is chunk 0. At most 255 bytes, or 512 with SID_CONF_EXTFRAME / CAN.
+						 * May be preceded by 7F B4 78 (ResponsePending) */
+	#define SID_HASHMAP_CMP	0x01
+	#define SID_HASHMAP_CRC32	0x02
+	#define SID_HASHMAP_MAXCHUNK	0x20000
+
+#define SID_SHA256 0xB3	/* SHA-256 of a range. format : <SID_SHA256> <A2> <A1> <A0> <L2> <L1> <L0>
+						 * response : <SID + 0x40> <32-byte digest>, same as sha256sum of the L bytes from <A2 A1 A0>.
+						 * Takes a few s per MB : progress is reported with 7F B3 78 (ResponsePending) every P2max / 2. */
+
 #define SID_WMBA 0x3D	/* WriteMemByAddress (RAM only !) . format : <SID_WMBA> <AH> <AM> <AL> <SIZ> <DATA> , siz <= 250. */
+				/* in an extended frame (SID_CONF_EXTFRAME), SIZ = 0 means the rest of the frame.
+				 * Note : RAM at 0xFFFF6000-0xFFFF6FFF, and XBUF_SIZE at XBUF_START (platf.h), holds kernel buffers.
+				 * Data for the WSTREAM area (see platf.h) is stored as it arrives, without FEC : a bad frame may
+				 * leave partial data there. */
 				/* response : <SID + 0x40> <AH> <AM> <AL> */
 
 #define SID_TP	0x3E	/* TesterPresent; not required but available. */
@@ -34,6 +82,16 @@
 #define SID_DUMP 0xBD	/* format : 0xBD <AS> <BH BL> <AH AL>  ; AS=0 for EEPROM, =1 for ROM, =3 for 95xxx EEPROM */
 	#define SID_DUMP_EEPROM	0
 	#define SID_DUMP_ROM 1
+	#define SID_DUMP_SEQ 0x80	/* flag, OR'd with AS : each response is <0xFD> <SEQH> <SEQL> <data...> , seq starting at 0,
+								* so a lost packet can be re-requested alone. */
+	#define SID_DUMP_LZ 0x40	/* flag, OR'd with AS, ROM only : each response is <0xFD> [<SEQH> <SEQL>] <MODE> <data...>
+								* Packets still cover DUMPLEN bytes of ROM each (max LZ_MAXBLK = 512), but data is either
+								* raw or compressed on its own. Tokens : 0x00-0x7F : T+1 literal bytes follow;
+								* 0x80-0xFF <DH> <DL> : copy (T & 0x7F) + 3 bytes from D bytes back (copies may overlap).
+								* Use a large DUMPLEN (e.g. with SID_CONF_EXTFRAME) for a worthwhile ratio.
+								* Mainly useful for erased / padded regions : code barely compresses (~98%). */
+		#define SID_DUMP_LZRAW	0
+		#define SID_DUMP_LZPACKED	1
 
 /* 95xxx EEPROM read/write using kernel's own functions */
 
@@ -58,9 +116,65 @@
 #define SID_FLASH 0xBC	/* low-level reflash commands; only available after successful RequestDownload */
 	#define SIDFL_UNPROTECT 0x55	//enable erase / write. format : <SID_FLASH> <SIDFL_UNPROTECT> <~SIDFL_UNPROTECT>
 	#define SIDFL_EB	0x01	//erase block. format : <SID_FLASH> <SIDFL_EB> <BLOCK #>
-	#define SIDFL_WB	0x02	//write n-byte block. format : <SID_FLASH> <SIDFL_WB> <A2> <A1> <A0> <D0>...<D(SIDFL_WB_DLEN -1)> <CRC>
+	#define SIDFL_WB	0x02	//write n-byte block. format : <SID_FLASH> <SIDFL_WB> <A2> <A1> <A0> <D0>...<D(n-1)> <CRC>
 						// Address is <A2 A1 A0>;   CRC is calculated on address + data.
-	#define SIDFL_WB_DLEN	128	//bytes per block
+						// n can be 1 to 249 : chunks are staged and written by SIDFL_WB_DLEN pages. A sequence of
+						// chunks must start on a page boundary and be contiguous. Traditionally n = SIDFL_WB_DLEN.
+						// A trailing partial page is only written by SIDFL_FLUSH; until then SIDFL_EB and
+						// SIDFL_WWOPEN are refused with PFWB_PENDING.
+						// In an extended frame (SID_CONF_EXTFRAME), n can be up to 2010.
+	#define SIDFL_WB_DLEN	128	//bytes per block (flash page)
+	#define SIDFL_WWOPEN	0x03	//start windowed write of N pages. format : <SID_FLASH> <SIDFL_WWOPEN> <A2> <A1> <A0> <NH> <NL>
+						// Address must be page-aligned. Page #seq will be written at <A2 A1 A0> + seq * SIDFL_WB_DLEN.
+	#define SIDFL_WWDATA	0x04	//windowed page, NOT answered. format : <SID_FLASH> <SIDFL_WWDATA> <SEQH> <SEQL> <D0>...<D127> <CRC>
+						// CRC is calculated on seq + data. Pages can be sent in any order, but at most 64 pages past
+						// the first missing one are accepted. Bad, duplicate or out-of-window pages are ignored.
+	#define SIDFL_WWSTAT	0x05	//windowed write status. format : <SID_FLASH> <SIDFL_WWSTAT>
+						// response : <SID_FLASH + 0x40> <ERR> <BH> <BL> <M0>...<M7>
+						// ERR : NRC of the first failed write (0 : ok; no more pages are written after a failure)
+						// B : first missing page (== N when done); M : bit n (LSB of M0 first) set if page B+n received.
+						// Typical use : send a burst of pages, SIDFL_WWSTAT, resend the missing ones, repeat.
+	#define SIDFL_FLUSH	0x06	//write the staged partial page, if any (padded with 0xFF), and report staging errors.
+						// format : <SID_FLASH> <SIDFL_FLUSH> ; response : <SID_FLASH + 0x40> <ERR> <A2> <A1> <A0>
+						// ERR : NRC of the first failed page write since the last SIDFL_FLUSH (0 : ok), and A the
+						// address of that page, i.e. where to resume; if ERR = 0, A is the end of the staged data.
+						// A chunk that completes a page gets the NRC if that page fails, even if the failing
+						// bytes were ACKed with an earlier chunk : always resume from A.
+
+#define SID_DSTREAM 0xB9	/* streaming dump (K-line only) :
+						 * <SID_DSTREAM> <SID_DSTREAM_START> <A2> <A1> <A0> <L2> <L1> <L0> <BH> <BL> <W> , or
+						 * <SID_DSTREAM> <SID_DSTREAM_CONT> <SEQH> <SEQL>
+						 * Both are answered with <SID_DSTREAM + 0x40> <NH> <NL> (N : number of B-byte blocks in the
+						 * L-byte range), immediately followed by up to W blocks (from block 0, or SEQ) as a raw stream
+						 * without iso framing : <data : B bytes (last block may be shorter)> <SEQH> <SEQL> <CRCH> <CRCL>
+						 * CRC = crc16() (see crc.c) of data + SEQ. The kernel then waits for the next request :
+						 * the host continues after the last good block, or from any block that failed.
+						 * B : 16 to 4096; W : 1 to 255, i.e. how often the host gets a turn on the half-duplex line. */
+	#define SID_DSTREAM_START	0x01
+	#define SID_DSTREAM_CONT	0x02
+
+#define SID_DIFFDUMP 0xB8	/* incremental dump : <SID_DIFFDUMP> <A2> <A1> <A0> <CSH> <CSL> <CRC0H> <CRC0L> ... <CRCn-1H> <CRCn-1L>
+						 * n chunks of CS bytes (32 to 4096) starting at <A2 A1 A0>; CRCx = crc16() (see crc.c) of the
+						 * host's copy of chunk x. Each chunk whose crc differs is sent in one or more packets
+						 * <SID_DIFFDUMP + 0x40> <A2> <A1> <A0> <data...> , sized as SID_DUMP packets (SID_CONF_DUMPLEN).
+						 * Last response : <SID_DIFFDUMP + 0x40> <NH> <NL> , N = number of chunks sent.
+						 * May be interleaved with 7F B8 78 (ResponsePending) while unchanged chunks are skipped. */
+
+#define SID_BATCH 0xBA	/* run several sub-requests from one frame : <SID_BATCH> <sub-request 1> ... <sub-request n>
+						 * They run in order and stop at the first failure. Response :
+						 * <SID_BATCH + 0x40> <N> <status 1>...<status N> , N = sub-requests run; status 0 = ok, else NRC
+						 * (so only the last one can be != 0). Flash sub-requests need SID_FLREQ, like SID_FLASH.
+						 * ResponsePending is sent while running (see SID_ATP). */
+	#define SID_BATCH_MAXOPS	64
+	#define SID_BATCH_EB	0x01	//erase block : <SID_BATCH_EB> <BLOCK #>
+	#define SID_BATCH_WRAM	0x02	//RAM write : <SID_BATCH_WRAM> <A2> <A1> <A0> <N> <D0>...<D(N-1)> , N = 1 to 255
+						// NRC 0x42 if outside RAM, or over the kernel (KERNEL_START-KERNEL_END in platf.h) or its buffers
+	#define SID_BATCH_WFL	0x03	//flash write from RAM : <SID_BATCH_WFL> <FA2> <FA1> <FA0> <RA2> <RA1> <RA0> <NH> <NL>
+						// same staging rules as SIDFL_WB (page-aligned start, contiguous chunks)
+	#define SID_BATCH_CRC	0x04	//compare crc16 (see crc.c) of memory : <SID_BATCH_CRC> <A2> <A1> <A0> <L2> <L1> <L0> <CRCH> <CRCL>
+						// NRC 0x77 if different. A2 >= 0x80 means RAM (0xFFxxxxxx), as in other SIDs
+	#define SID_BATCH_EEW	0x05	//EEPROM write, as SID_EE_WR16 : <SID_BATCH_EEW> <AH> <AL> <DH> <DL>
+						// RAM sources / destinations must be clear of the kernel buffers (see SID_WMBA)
 
 /* SID_CONF and subcommands */
 #define SID_CONF 0xBE /* set & configure kernel */
@@ -75,7 +189,79 @@
 		#define ROMCRC_CHUNKSIZE 256
 	#define SID_CONF_R16 0x04		/* for debugging : do a 16bit access read at given adress in RAM (top byte 0xFF)
 									* <SID_CONF> <SID_CONF_R16> <A2> <A1> <A0> */
+	#define SID_CONF_SESSMODE 0x06	/* line error handling : <SID_CONF> <SID_CONF_SESSMODE> <mode>
+									* mode 0 (default) : any line error resets comm + flash states (StartComm, RequestDownload needed again)
+									* mode 1 : a line error only discards the current frame; states are kept until
+									*	no valid frame is received for SESS_TIMEOUT ms, or ECU reset */
+	#define SID_CONF_TRYSPEED 0x07	/* tentative comm speed : <SID_CONF> <SID_CONF_TRYSPEED> <new divisor>
+									* responds at the old speed, then switches; session is kept. If not committed within
+									* 1 s, the kernel reverts to the last committed divisor.
+									* From the first TRYSPEED until the next SETSPEED, line errors are handled as in
+									* SID_CONF_SESSMODE 1, whatever the mode. */
+	#define SID_CONF_PROBE 0x08	/* link test : <SID_CONF> <SID_CONF_PROBE> <pattern...> (up to 252 bytes)
+									* response : <SID_CONF + 0x40> <line errors> <bad frames> <pattern...>
+									* counts are since the last TRYSPEED, saturated at 0xFF */
+	#define SID_CONF_COMMIT 0x09	/* keep the tentative speed : <SID_CONF> <SID_CONF_COMMIT> <~SID_CONF_COMMIT>
+									* The previously committed divisor becomes the fallback : if >= 4 of 32 frames are bad,
+									* the kernel silently drops back to it. SID_CONF_SETSPEED disables the fallback. */
+	#define SID_CONF_STATS 0x0A	/* session counters : <SID_CONF> <SID_CONF_STATS> <reset>
+									* response : <SID_CONF + 0x40> <GOOD> <BAD> <LINEERR> <NRC> <FEC> , u16 each (H L)
+									* GOOD, BAD : valid / rejected frames; LINEERR : ORER|FER|PER; NRC : negative responses sent;
+									* FEC : frames repaired by FEC.
+									* Cleared by StartComm, or after reading if <reset> != 0 */
+	#define SID_CONF_DUMPLEN 0x0B	/* SID_DUMP packet size : <SID_CONF> <SID_CONF_DUMPLEN> <len> , even, 2 to 254 (default 32)
+									* or <SID_CONF> <SID_CONF_DUMPLEN> <LH> <LL> , up to 2012, used for ROM with SID_CONF_EXTFRAME */
+	#define SID_CONF_FEC 0x0C	/* FEC framing : <SID_CONF> <SID_CONF_FEC> <depth> , 0 (off, default) to 4. Reset by StartComm.
+									* When on, SID_FLASH and SID_WMBA requests and SID_DUMP responses carry 2 * <depth> parity bytes
+									* between the payload (SID included) and the iso checksum; the frame length includes them.
+									* SID_DUMP packets are shortened to fit. See fec.c for the code. */
+	#define SID_CONF_EXTFRAME 0x0D	/* extended frames : <SID_CONF> <SID_CONF_EXTFRAME> <enable> ; response <SID_CONF + 0x40> <MAXH> <MAXL>
+									* When enabled, requests may also use the non-standard format
+									* <0x40> <LENH> <LENL> <data...> <CRCH> <CRCL> , LEN = 1 to MAX (2016) data bytes,
+									* CRC = crc16() (see crc.c) over the whole frame, big-endian. Reset by StartComm.
+									* Useful with SID_WMBA, SID_FLASH / SIDFL_WB, and SID_DUMP (ROM) : ROM dump packets longer than
+									* 254 bytes (SID_CONF_DUMPLEN, 16-bit form) are sent in this format. No FEC on extended frames. */
+	#define SID_CONF_CAPS 0x0E	/* capability + geometry descriptor : <SID_CONF> <SID_CONF_CAPS> <0>
+									* response, multi-byte fields big-endian :
+									* <SID_CONF + 0x40> <CAPS_VERSION> <CAPS_PLATF_*> <CAPS_F_* features : 2>
+									* <RAM_MIN : 4> <RAM_MAX : 4> <kernel buffer area start : 4> <size : 2>
+									* <flash page / write staging size : 2> <SIDFL_WW window (pages)> <max ext. frame data : 2>
+									* <max FEC depth> <default BRR divisor> <current BRR divisor> (any divisor 0-255 is accepted)
+									* <n> <SID 1>...<SID n> (supported SIDs)
+									* <SID_CONF subcommands : 2> (bit n set : subcommand n supported)
+									* <n> <SIDFL sub 1>...<SIDFL sub n>
+									* <n> <block 0 start : 3> ... <block n-1 start : 3> <ROM size : 3> (erase blocks)
+									* <2nd kernel buffer area start : 4> <size : 2> (target-specific, see XBUF) */
+		#define CAPS_VERSION	2
+		#define CAPS_PLATF_7058	0
+		#define CAPS_PLATF_7055_18	1
+		#define CAPS_PLATF_7055_35	2
+		#define CAPS_F_PEVERIFY	0x0001	//POSTERASE_VERIFY
+		#define CAPS_F_U16READ	0x0002	//DIAG_U16READ : SID_CONF_R16
+		#define CAPS_F_FEC	0x0004	//SID_CONF_FEC
+		#define CAPS_F_EXTFRAME	0x0008	//SID_CONF_EXTFRAME
+		#define CAPS_F_WWRITE	0x0010	//SIDFL_WWOPEN etc
+		#define CAPS_F_DUMPSEQ	0x0020	//SID_DUMP_SEQ
+		#define CAPS_F_RSPPEND	0x0040	//ResponsePending during long operations
+		#define CAPS_F_CAN	0x0080	//CAN_TRANSPORT, and HCAN0 responded at startup : ISO-TP on HCAN0, SID_CONF_CANTP
+		#define CAPS_F_DUMPLZ	0x0100	//SID_DUMP_LZ
+	#define SID_CONF_CANTP 0x0F	/* ISO-TP FlowControl sent to the tester : <SID_CONF> <SID_CONF_CANTP> <BS> <STmin>
+									* (default 0 0). Only with CAN_TRANSPORT (SH7058) : requests on ID 0x7E0, responses on 0x7E8,
+									* 500kbps. Payload is as over K-line, without header / checksum; up to 2016 bytes each way.
+									* Responses go to the transport the last request came from. See can_tp.c */
+
 
+#define SID_ATP 0x83	/* AccessTimingParameters. format : <SID_ATP> <TPI> [<P2min> <P2max> <P3min> <P3max> <P4min>]
+						 * units as iso14230 : P2min, P3min, P4min : 0.5ms; P2max : 25ms; P3max : 250ms.
+						 * response : <SID_ATP + 0x40> <TPI> [<P2min> ... <P4min>] (values only for the READ TPIs)
+						 * The kernel honours P2min (delays its responses), P2max (long flash / EEPROM operations send
+						 * 7F <SID> 78 ResponsePending every P2max / 2) and P3max (session timeout in SID_CONF_SESSMODE 1,
+						 * max 40 = 10 s). P3min = P4min = 0 always work, i.e. minimal-gap mode.
+						 * P2min is clamped to P2max / 4 (i.e. half the ResponsePending interval); READCUR shows the value used. */
+	#define SID_ATP_READLIMITS	0x00	//most aggressive values supported : 0 1 0 40 0
+	#define SID_ATP_SETDEFAULT	0x01	//0 2 0 20 0, i.e. immediate responses + 5 s session timeout
+	#define SID_ATP_READCUR	0x02
+	#define SID_ATP_SET	0x03
 
 #define SID_FLREQ 0x34	/* RequestDownload */
 
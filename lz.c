@@ -0,0 +1,91 @@
+/* Byte-oriented LZ77 compression for dumps, see SID_DUMP_LZ
+ *
+ * Output is a sequence of tokens :
+ *	0x00-0x7F : T + 1 literal bytes follow
+ *	0x80-0xFF : match; copy (T & 0x7F) + 3 bytes from <DH> <DL> bytes back in the output.
+ *		Copies may overlap (D = 1 repeats the last byte), which covers runs of 0xFF.
+ * Each block is compressed on its own; matches never reach before the start of the block.
+ *
+ * Matches are found by a 3-byte hash of the source, which is read in place (ROM),
+ * so the only RAM used is the hash table.
+ *
+ * What this buys is mostly erased / padded flash : 512 bytes of 0xFF pack to 15, but SH-2 code to
+ * ~98% (test/lzbench.c).
+ */
+
+#include <string.h>	//memset
+#include "stypes.h"
+#include "platf.h"	//XBUF
+#include "lz.h"
+
+#define LZ_HBITS	8
+#define LZ_MINMATCH	3
+#define LZ_MAXMATCH	(0x7F + LZ_MINMATCH)
+#define LZ_MAXLIT	0x80
+#define LZ_NONE	0xFFFF
+
+static u16 lz_htab[1 << LZ_HBITS] XBUF;	//last position of each hash, in current block
+
+static unsigned lz_hash(const u8 *p) {
+	return ((p[0] << 4) ^ (p[1] << 2) ^ p[2] ^ (p[0] >> 4)) & ((1 << LZ_HBITS) - 1);
+}
+
+/* append literals; @return new output length, 0 if dmax exceeded */
+static unsigned lz_lits(const u8 *src, unsigned n, u8 *dst, unsigned op, unsigned dmax) {
+	while (n) {
+		unsigned c = (n > LZ_MAXLIT) ? LZ_MAXLIT : n;
+		if ((op + 1 + c) > dmax) return 0;
+		dst[op++] = c - 1;
+		memcpy(&dst[op], src, c);
+		op += c;
+		src += c;
+		n -= c;
+	}
+	return op;
+}
+
+/** compress src[0..len-1] into dst[]; len <= LZ_MAXBLK
+ * @return compressed length, or 0 if it would exceed dmax bytes
+ */
+unsigned lz_pack(const u8 *src, unsigned len, u8 *dst, unsigned dmax) {
+	unsigned ip = 0;	//current source pos
+	unsigned lit = 0;	//start of pending literals
+	unsigned op = 0;
+
+	memset(lz_htab, 0xFF, sizeof(lz_htab));
+
+	while ((ip + LZ_MINMATCH) <= len) {
+		unsigned h = lz_hash(&src[ip]);
+		unsigned cand = lz_htab[h];
+		unsigned mlen = 0;
+
+		lz_htab[h] = ip;
+		if (cand != LZ_NONE) {
+			unsigned max = len - ip;
+			if (max > LZ_MAXMATCH) max = LZ_MAXMATCH;
+			while ((mlen < max) && (src[cand + mlen] == src[ip + mlen])) {
+				mlen++;
+			}
+		}
+		if (mlen < LZ_MINMATCH) {
+			ip++;
+			continue;
+		}
+
+		if (ip != lit) {
+			op = lz_lits(&src[lit], ip - lit, dst, op, dmax);
+			if (!op) return 0;
+		}
+		if ((op + 3) > dmax) return 0;
+		dst[op++] = 0x80 | (mlen - LZ_MINMATCH);
+		dst[op++] = (ip - cand) >> 8;
+		dst[op++] = (ip - cand) & 0xFF;
+		ip += mlen;
+		lit = ip;
+	}
+
+	if (lit != len) {
+		op = lz_lits(&src[lit], len - lit, dst, op, dmax);
+	}
+	return op;
+}
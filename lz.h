@@ -0,0 +1,10 @@
+#ifndef _LZ_H
+#define _LZ_H
+
+#include "stypes.h"
+
+#define LZ_MAXBLK	512	//max source block size for lz_pack()
+
+unsigned lz_pack(const u8 *src, unsigned len, u8 *dst, unsigned dmax);
+
+#endif
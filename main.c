@@ -23,6 +23,7 @@
 
 #include "platf.h"
 #include "cmd_parser.h"
+#include "can_tp.h"
    
 
 /**** "preload" info struct filled before calling RAMjump. This probably varies but seems typical ? *****/
@@ -94,6 +95,9 @@ void main(void) {
 	set_imask(0x07);
 
 	cmd_init(SCI_DEFAULTDIV);
+#ifdef CAN_TRANSPORT
+	can_init();
+#endif
 	cmd_loop();
 
 	//we should never get here; if so : die
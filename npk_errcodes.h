@@ -37,6 +37,8 @@
 #define PFWB_MISALIGNED (0x88 | 0x01)	//dest not on 128B boundary
 #define PFWB_LEN (0x88 | 0x02)		//len not multiple of 128
 #define PFWB_VERIFAIL (0x88 | 0x03)	//post-write verify failed
+#define PFWB_SEQ (0x88 | 0x05)	//chunk not contiguous with staged data (see SIDFL_WB)
+#define PFWB_PENDING (0x88 | 0x06)	//a partial page is staged : SIDFL_FLUSH first
 
 
 /**** 7055 (350nm) codes  */
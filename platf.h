@@ -24,6 +24,10 @@
 /****** kernel customization ******/
 #define SCI_DEFAULTDIV 9	//default value for BRR reg. Speed (kbps) = (20 * 1000) / (32 * (BRR + 1))
 
+/* P1 limit, ms : a longer gap between request bytes makes the kernel drop the partial frame.
+ * Raise it for adapters that pause mid-frame (e.g. USB latency); fixed at build time */
+#define P1_MAX	10
+
 /* Uncomment to enable verification of succesful block erase . Adds 128B for the block descriptors + ~ 44B of code */
 //#define POSTERASE_VERIFY
 
@@ -33,33 +37,64 @@
 /* Uncomment to taint WDT pulse for debug use */
 //#define DIAG_TAINTWDT
 
+/* Comment out to remove the ISO-TP transport on HCAN0 (SH7058 only, see can_tp.c). ~1kB of code */
+#define CAN_TRANSPORT
+
 
 
 #include <stdbool.h>
 
 
+/* WSTREAM : RAM area clear of the kernel, its buffers and the flash microcode. SID_WMBA data for
+ * this area is written as it is received, instead of after the whole frame is checked.
+ */
 #if defined(SH7058)
 
 #define RAM_MIN	0xFFFF0000
 #define RAM_MAX 	0xFFFFBFFF
+#define XBUF_START	0xFFFF2000	//must match RXBUF in lkr_7058.ld
+#define WSTREAM_MIN	0xFFFF3400	//above the flash microcode and XBUF
+#define WSTREAM_MAX	0xFFFF5FFF
 
 #elif defined(SH7055_18)
 
 #define RAM_MIN	0xFFFF6000
 #define RAM_MAX	0xFFFFDFFF
+#define XBUF_START	0xFFFFC000	//must match RXBUF in lkr_7055.ld
+#define WSTREAM_MIN	0xFFFFD400	//above the stack and XBUF
+#define WSTREAM_MAX	0xFFFFDFFF
 
 #elif defined(SH7055_35)
 
 #define RAM_MIN	0xFFFF6000
 #define RAM_MAX	0xFFFFDFFF
+#define XBUF_START	0xFFFFC000
+#define WSTREAM_MIN	0xFFFFD400
+#define WSTREAM_MAX	0xFFFFDFFF
 
 #else
 #error No target specified !
 #endif
 
+#if !defined(SH7058)
+#undef CAN_TRANSPORT	//no HCAN on the OBD port
+#endif
+
+/* for large static buffers : placed outside the payload area, see .ld file. Not zeroed on startup */
+#define BIGBUF __attribute__ ((section (".bigbuf")))
+#define BIGBUF_START	0xFFFF6000	//must match RBIG in .ld file
+#define BIGBUF_SIZE	(4 * 1024)
+/* same, in a target-specific area (XBUF_START) */
+#define XBUF __attribute__ ((section (".xbuf")))
+#define XBUF_SIZE	(5 * 1024)	//must match RXBUF in lkr_7055.ld / lkr_7058.ld
+
 /* where the pre-ramjump metadata is stored (wdt pin, s36k2, etc) */
 #define RAMJUMP_PRELOAD_META 0xffff8000
 
+/* the running kernel : metadata, code + data + bss, and stack (RMETA, RJFIX, _stackinit in .ld file) */
+#define KERNEL_START	RAMJUMP_PRELOAD_META
+#define KERNEL_END	0xFFFFBFFF
+
 /*** WDT and master clock stuff */
 #define WDT_PER_MS	2
 	/* somehow shc sucks at reducing the following :
@@ -76,6 +111,12 @@
 #define get_mclk_ts(x) (ATU0.TCNT)
 
 
+/** Flash erase blocks, defined in the platf_*nm.c file :
+ * fblocks[n] is the start of block n; fblocks[PF_NUMBLOCKS] is the ROM size.
+ */
+#define PF_NUMBLOCKS	16
+extern const u32 fblocks[];
+
 /** Ret 1 if ok
  *
  * sets *err to a negative response code if failed
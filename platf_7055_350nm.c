@@ -366,9 +366,10 @@ static void writepulse(volatile u8 *dest, u8 *src, unsigned tsp) {
  * assumes params are ok, and that block was already erased
  */
 static u32 flash_write128(u32 dest, u32 src_unaligned) {
-	u8 src[128] __attribute ((aligned (4)));	// aligned copy of desired data
-	u8 reprog[128] __attribute ((aligned (4)));	// retry / reprogram data
-	u8 addit[128] __attribute ((aligned (4)));	// overwrite / additional data
+	/* 384 bytes is too much for the stack */
+	static u8 src[128] XBUF __attribute ((aligned (4)));	// aligned copy of desired data
+	static u8 reprog[128] XBUF __attribute ((aligned (4)));	// retry / reprogram data
+	static u8 addit[128] XBUF __attribute ((aligned (4)));	// overwrite / additional data
 
 	unsigned n;
 	bool m;
@@ -42,6 +42,11 @@ static void init_sci(void) {
 /******* Interrupt stuff */
 void die(void);
 void wdt_tog(void);
+void cmd_tick(void);	//in cmd_parser.c
+void INT_SCI1_RXI1(void) ISR;	//in cmd_parser.c
+void INT_SCI1_ERI1(void) ISR;
+void INT_SCI1_TXI1(void) ISR;
+void INT_SCI1_TEI1(void) ISR;
 
 /** WDT toggle interrupt
  *
@@ -55,6 +60,7 @@ void INT_ATU11_IMI1A(void) {
 	ATU1.TCNTB = 0;
 	//ATU1.TSRA.BIT.IMFA = 0 ;
 	ATU1.TSRB.BIT.CMF = 0;	//TCNT1B compare match
+	cmd_tick();
 	return;
 }
 
@@ -111,14 +117,15 @@ void die_trace(void) {
 /** Runtime-generated IVT (Interrupt / exception vector table).
  * Goal : save ~ 1kB kernel size.
  * Unused entries are set to point to the "dummy" ISR;
- * the vbr reg will be set to point at this table at startup, so this can be anywhere in RAM.
+ * the vbr reg will be set to point at this table at startup, so this can be anywhere in RAM :
+ * it is entirely rebuilt, so it goes in XBUF instead of the kernel's bss.
  */
 
 #define IVT_ENTRIES 0x100
 #define IVT_DEFAULTENTRY ((u32) &die_trace)
 #define ARRAY_SIZE(x)	(sizeof(x) / sizeof((x)[0]))
 
-u32 ivt[IVT_ENTRIES];
+u32 ivt[IVT_ENTRIES] XBUF;
 
 extern u32 stackinit[];	/* ptr set at linkage */
 
@@ -137,6 +144,10 @@ static void build_ivt(u32 *dest) {
 	WRITEVECT(IVTN_POR_SP, stackinit);
 	WRITEVECT(IVTN_MR_SP, stackinit);
 	WRITEVECT(IVTN_INT_ATU11_IMI1A, &INT_ATU11_IMI1A);
+	WRITEVECT(IVTN_INT_SCI1_ERI1, &INT_SCI1_ERI1);
+	WRITEVECT(IVTN_INT_SCI1_RXI1, &INT_SCI1_RXI1);
+	WRITEVECT(IVTN_INT_SCI1_TXI1, &INT_SCI1_TXI1);
+	WRITEVECT(IVTN_INT_SCI1_TEI1, &INT_SCI1_TEI1);
 
 }
 
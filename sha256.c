@@ -0,0 +1,113 @@
+/* SHA-256 (FIPS 180-4), see SID_SHA256
+ *
+ * Small rather than fast : the message schedule is kept as a rolling 16-word window (in XBUF),
+ * and whole blocks are hashed straight from ROM.
+ * Not measured on SH-2 yet. SH-2 has no barrel shifter, so each 32-bit rotate takes several
+ * instructions : expect ~100-150 cy/B, i.e. 3-4 s for 1MB @ 40MHz. To measure, time a 1MB
+ * SID_SHA256 request (see doc/test_commands.txt).
+ */
+
+#include <string.h>	//memcpy, memset
+#include "stypes.h"
+#include "platf.h"	//XBUF
+#include "sha256.h"
+
+static const u32 sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROR(x, n)	(((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_block(u32 *h, const u8 *p) {
+	static u32 w[16] XBUF;
+	u32 s[8];
+	unsigned i, j;
+
+	for (i = 0; i < 16; i++, p += 4) {
+		w[i] = ((u32) p[0] << 24) | ((u32) p[1] << 16) | ((u32) p[2] << 8) | p[3];
+	}
+	memcpy(s, h, sizeof(s));
+
+	for (i = 0; i < 64; i++) {
+		u32 t1, t2;
+
+		if (i >= 16) {
+			u32 w15 = w[(i + 1) & 15];
+			u32 w2 = w[(i + 14) & 15];
+			w[i & 15] += (ROR(w15, 7) ^ ROR(w15, 18) ^ (w15 >> 3)) + w[(i + 9) & 15]
+						+ (ROR(w2, 17) ^ ROR(w2, 19) ^ (w2 >> 10));
+		}
+		t1 = s[7] + (ROR(s[4], 6) ^ ROR(s[4], 11) ^ ROR(s[4], 25)) + ((s[4] & s[5]) ^ (~s[4] & s[6]))
+			+ sha256_k[i] + w[i & 15];
+		t2 = (ROR(s[0], 2) ^ ROR(s[0], 13) ^ ROR(s[0], 22)) + ((s[0] & s[1]) ^ (s[0] & s[2]) ^ (s[1] & s[2]));
+		for (j = 7; j; j--) {
+			s[j] = s[j - 1];
+		}
+		s[4] += t1;
+		s[0] = t1 + t2;
+	}
+
+	for (i = 0; i < 8; i++) {
+		h[i] += s[i];
+	}
+}
+
+void sha256_init(struct sha256_ctx *ctx) {
+	static const u32 h0[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+
+	memcpy(ctx->h, h0, sizeof(h0));
+	ctx->len = 0;
+}
+
+void sha256_update(struct sha256_ctx *ctx, const u8 *data, u32 len) {
+	unsigned fill = ctx->len & 63;
+
+	ctx->len += len;
+	if (fill) {
+		unsigned n = 64 - fill;
+
+		if (n > len) n = len;
+		memcpy(&ctx->buf[fill], data, n);
+		data += n;
+		len -= n;
+		if ((fill + n) < 64) return;
+		sha256_block(ctx->h, ctx->buf);
+	}
+	for (; len >= 64; len -= 64, data += 64) {
+		sha256_block(ctx->h, data);	//straight from the source
+	}
+	memcpy(ctx->buf, data, len);
+}
+
+void sha256_final(struct sha256_ctx *ctx, u8 *digest) {
+	u32 bits_hi = ctx->len >> 29;
+	u32 bits_lo = ctx->len << 3;
+	unsigned fill = ctx->len & 63;
+	unsigned i;
+
+	ctx->buf[fill++] = 0x80;
+	if (fill > 56) {
+		memset(&ctx->buf[fill], 0, 64 - fill);
+		sha256_block(ctx->h, ctx->buf);
+		fill = 0;
+	}
+	memset(&ctx->buf[fill], 0, 56 - fill);
+	for (i = 0; i < 4; i++) {
+		ctx->buf[56 + i] = bits_hi >> (24 - (8 * i));
+		ctx->buf[60 + i] = bits_lo >> (24 - (8 * i));
+	}
+	sha256_block(ctx->h, ctx->buf);
+
+	for (i = 0; i < 32; i++) {
+		digest[i] = ctx->h[i / 4] >> (24 - (8 * (i & 3)));
+	}
+}
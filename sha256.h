@@ -0,0 +1,18 @@
+#ifndef _SHA256_H
+#define _SHA256_H
+
+#include "stypes.h"
+
+#define SHA256_DIGESTLEN	32
+
+struct sha256_ctx {
+	u32 h[8];
+	u32 len;	//total bytes hashed so far
+	u8 buf[64];	//partial block
+};
+
+void sha256_init(struct sha256_ctx *ctx);
+void sha256_update(struct sha256_ctx *ctx, const u8 *data, u32 len);
+void sha256_final(struct sha256_ctx *ctx, u8 *digest);
+
+#endif
@@ -0,0 +1,107 @@
+/* Host benchmark for lz.c (SID_DUMP_LZ) : ratio and time per byte on ROM images.
+ * Build with "make -C test lzbench" (native gcc); "make -C test bench" runs it on the precompiled kernels.
+ *
+ * usage : lzbench <blocksize> <image>...
+ * Each image is cut in <blocksize> packets and compressed as cmd_dump() does, counting the
+ * mode byte and falling back to raw when compression doesn't help. Every block is decoded
+ * again and compared.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "stypes.h"
+#include "lz.h"
+
+/** reference decoder, as a host would implement it */
+static unsigned lz_unpack(const u8 *src, unsigned len, u8 *dst) {
+	unsigned ip = 0, op = 0;
+
+	while (ip < len) {
+		unsigned t = src[ip++];
+		if (t < 0x80) {
+			memcpy(&dst[op], &src[ip], t + 1);
+			ip += t + 1;
+			op += t + 1;
+		} else {
+			unsigned n = (t & 0x7F) + 3;
+			unsigned d = (src[ip] << 8) | src[ip + 1];
+			ip += 2;
+			for (; n; n--, op++) {
+				dst[op] = dst[op - d];
+			}
+		}
+	}
+	return op;
+}
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+int main(int argc, char **argv) {
+	unsigned blk;
+	int i;
+
+	if (argc < 3) {
+		fprintf(stderr, "usage : %s <blocksize> <image>...\n", argv[0]);
+		return 1;
+	}
+	blk = atoi(argv[1]);
+	if ((blk < 16) || (blk > LZ_MAXBLK)) {
+		fprintf(stderr, "blocksize must be 16 to %u\n", LZ_MAXBLK);
+		return 1;
+	}
+
+	for (i = 2; i < argc; i++) {
+		static u8 img[4 * 1024 * 1024];
+		u8 out[LZ_MAXBLK], dec[LZ_MAXBLK];
+		unsigned long total = 0;
+		size_t len, pos;
+		double t0, t;
+		int rep, nrep;
+		FILE *f = fopen(argv[i], "rb");
+
+		if (!f) {
+			perror(argv[i]);
+			return 1;
+		}
+		len = fread(img, 1, sizeof(img), f);
+		fclose(f);
+		if (!len) continue;
+
+		/* verify + size */
+		for (pos = 0; pos < len; pos += blk) {
+			unsigned n = ((len - pos) < blk) ? (len - pos) : blk;
+			unsigned c = lz_pack(&img[pos], n, out, n - 1);
+			if (c) {
+				if ((lz_unpack(out, c, dec) != n) || memcmp(dec, &img[pos], n)) {
+					printf("%s : decode mismatch @ 0x%zX\n", argv[i], pos);
+					return 1;
+				}
+				total += c + 1;
+			} else {
+				total += n + 1;
+			}
+		}
+
+		/* timing : repeat to get at least ~0.2 s */
+		nrep = 1 + (int) ((8UL * 1024 * 1024) / len);
+		t0 = now();
+		for (rep = 0; rep < nrep; rep++) {
+			for (pos = 0; pos < len; pos += blk) {
+				unsigned n = ((len - pos) < blk) ? (len - pos) : blk;
+				lz_pack(&img[pos], n, out, n - 1);
+			}
+		}
+		t = (now() - t0) / nrep;
+
+		printf("%s : %zu -> %lu bytes (%.1f%%), %.1f ns/B\n", argv[i], len, total,
+			100.0 * total / len, 1e9 * t / len);
+	}
+	return 0;
+}
@@ -0,0 +1,625 @@
+/* Host test for can_tp.c : ISO-TP segmentation / reassembly against a model of the HCAN0 mailboxes.
+ *
+ * can_tp.c is compiled in this file, with HCAN pointing to hcan_access() : every register access
+ * first steps the model, so busy-wait loops make progress. get_mclk_ts() is a simulated clock that
+ * advances one tick per call, and also steps the model.
+ * The model only knows what can_tp.c uses : MB0 receives, MB1 transmits.
+ * Write-1-to-clear bits (RXPR0) are set along with a sentinel bit the kernel never writes, so the
+ * model can tell when the kernel cleared them.
+ *
+ * The tester side is scripted per test : frames queued for the kernel (with a due time), and an
+ * automatic FlowControl responder for the kernel's multi-frame responses.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stypes.h"
+#include "platf.h"
+#include "reg_defines/7055_7058_180nm.h"
+
+static volatile struct st_hcan2 *hcan_access(void);
+static u32 sim_ts(void);
+static void hcan_step(void);
+
+#define HCAN	(*hcan_access())
+#undef get_mclk_ts
+#define get_mclk_ts(x)	sim_ts()
+
+#include "../can_tp.c"
+
+#define RXPR_SENTINEL	0x8000	//MB15 : never used by can_tp.c
+
+static volatile struct st_hcan2 hcan;
+static u32 sim_now;
+
+/* tester -> kernel */
+#define RXQ_MAX	1024
+static struct {
+	u8 d[8];
+	u8 dlc;
+	u32 due;
+} rxq[RXQ_MAX];
+static unsigned rxq_head, rxq_tail;
+
+/* kernel -> tester */
+#define TXLOG_MAX	1024
+static struct {
+	u8 d[8];
+	u32 ts;
+} txlog[TXLOG_MAX];
+static unsigned txlog_n;
+
+static bool bus_ok = 1;	//0 : frames are never acknowledged (e.g. bus-off)
+static unsigned aborts;	//TXCR0 requests seen
+static bool hcan_dead;	//1 : RSB never follows RSTRQ (module left stopped by the ECU firmware)
+static bool abort_stuck;	//1 : TXCR0 requests are ignored
+
+/* automatic FC responder, for can_send() tests */
+static enum { FC_NONE, FC_CTS, FC_WAIT2, FC_OVFLW } fc_mode;
+static u8 tst_bs, tst_st;	//BS and STmin sent to the kernel
+static unsigned fc_cfcount;	//CFs since the last FC
+static unsigned fc_sent;
+
+static unsigned failures;
+
+#define CHECK(c) do { \
+	if (!(c)) { \
+		printf("%s:%d: FAIL %s\n", __func__, __LINE__, #c); \
+		failures += 1; \
+	} \
+} while (0)
+
+static u32 sim_ts(void) {
+	hcan_step();	//e.g. frames go out while can_send() waits for STmin
+	return sim_now++;
+}
+
+static void tester_queue(const u8 *d, unsigned dlc, u32 delay) {
+	unsigned i = rxq_head % RXQ_MAX;
+
+	memset(rxq[i].d, 0, 8);
+	memcpy(rxq[i].d, d, dlc);
+	rxq[i].dlc = dlc;
+	rxq[i].due = sim_now + delay;
+	rxq_head += 1;
+	return;
+}
+
+static void tester_fc(u8 fs, u32 delay) {
+	u8 f[8] = {PCI_FC | fs, tst_bs, tst_st, 0, 0, 0, 0, 0};
+	tester_queue(f, 8, delay);
+	fc_sent += 1;
+	return;
+}
+
+/* kernel sent a frame : log it, and answer FF / end of block if scripted */
+static void tester_rx(const volatile u8 *d) {
+	unsigned i;
+
+	if (txlog_n < TXLOG_MAX) {
+		for (i = 0; i < 8; i++) {
+			txlog[txlog_n].d[i] = d[i];
+		}
+		txlog[txlog_n].ts = sim_now;
+		txlog_n += 1;
+	}
+
+	switch (d[0] & 0xF0) {
+	case PCI_FF:
+		fc_cfcount = 0;
+		switch (fc_mode) {
+		case FC_CTS:
+			tester_fc(FS_CTS, 10);
+			break;
+		case FC_WAIT2:
+			//two WAITs spanning more than N_TIMEOUT, then CTS
+			tester_fc(FS_WAIT, MCLK_GETTS(600));
+			tester_fc(FS_WAIT, MCLK_GETTS(1200));
+			tester_fc(FS_CTS, MCLK_GETTS(1800));
+			break;
+		case FC_OVFLW:
+			tester_fc(FS_OVFLW, 10);
+			break;
+		default:
+			break;
+		}
+		break;
+	case PCI_CF:
+		fc_cfcount += 1;
+		if (tst_bs && (fc_cfcount == tst_bs)) {
+			fc_cfcount = 0;
+			tester_fc(FS_CTS, 10);
+		}
+		break;
+	default:
+		break;
+	}
+	return;
+}
+
+static void hcan_step(void) {
+	if (!hcan_dead) {
+		hcan.GSR.BIT.RSB = hcan.MCR.BIT.RSTRQ;
+	}
+
+	if ((hcan.TXCR0.WORD & (1 << MB_TX)) && !abort_stuck) {
+		hcan.TXPR0.WORD &= ~(1 << MB_TX);
+		hcan.TXCR0.WORD = 0;
+		aborts += 1;
+	}
+	if ((hcan.TXPR0.WORD & (1 << MB_TX)) && bus_ok) {
+		tester_rx(hcan.MB[MB_TX].MSG_DATA);
+		hcan.TXPR0.WORD &= ~(1 << MB_TX);
+		hcan.TXACK0.WORD |= 1 << MB_TX;
+	}
+
+	if (hcan.RXPR0.WORD && !(hcan.RXPR0.WORD & RXPR_SENTINEL)) {
+		hcan.RXPR0.WORD = 0;	//kernel cleared RXPR0
+	}
+	if (!hcan.RXPR0.WORD && (rxq_tail != rxq_head) && ((int32_t) (sim_now - rxq[rxq_tail % RXQ_MAX].due) >= 0)) {
+		unsigned i, q = rxq_tail % RXQ_MAX;
+		for (i = 0; i < 8; i++) {
+			hcan.MB[MB_RX].MSG_DATA[i] = rxq[q].d[i];
+		}
+		hcan.MB[MB_RX].CTRLL.BIT.DLC = rxq[q].dlc;
+		hcan.RXPR0.WORD = (1 << MB_RX) | RXPR_SENTINEL;
+		rxq_tail += 1;
+	}
+	return;
+}
+
+static volatile struct st_hcan2 *hcan_access(void) {
+	hcan_step();
+	return &hcan;
+}
+
+static void reset(void) {
+	memset((void *) &hcan, 0, sizeof(hcan));
+	rxq_head = rxq_tail = 0;
+	txlog_n = 0;
+	bus_ok = 1;
+	aborts = 0;
+	hcan_dead = 0;
+	abort_stuck = 0;
+	fc_mode = FC_NONE;
+	tst_bs = 0;
+	tst_st = 0;
+	fc_cfcount = 0;
+	fc_sent = 0;
+	sim_now += MCLK_GETTS(5000);	//let any N_Cr timer from the previous test expire
+	CHECK(can_init());
+	can_setfc(0, 0);
+	(void) can_poll(NULL, 0);	//drop stale reassembly state
+	return;
+}
+
+/** poll until the tester has nothing left to send; time passes meanwhile
+ * @return first nonzero can_poll() result
+ */
+static unsigned poll_all(u8 *buf, unsigned maxlen) {
+	unsigned r;
+
+	while (1) {
+		r = can_poll(buf, maxlen);
+		hcan_step();	//let FCs out
+		if (r) return r;
+		if ((rxq_tail == rxq_head) && !(hcan.RXPR0.WORD & (1 << MB_RX))) break;
+		sim_now += 16;
+	}
+	return 0;
+}
+
+/** reassemble the kernel's response from txlog[]
+ * @return length, 0 if malformed
+ */
+static unsigned txlog_message(u8 *out, unsigned maxlen) {
+	unsigned k, len, pos, n;
+	u8 sn = 1;
+
+	if (!txlog_n) return 0;
+	if ((txlog[0].d[0] & 0xF0) == PCI_SF) {
+		len = txlog[0].d[0] & 0x0F;
+		if (len > maxlen) return 0;
+		memcpy(out, &txlog[0].d[1], len);
+		return len;
+	}
+	if ((txlog[0].d[0] & 0xF0) != PCI_FF) return 0;
+	len = ((txlog[0].d[0] & 0x0F) << 8) | txlog[0].d[1];
+	if (len > maxlen) return 0;
+	memcpy(out, &txlog[0].d[2], 6);
+	pos = 6;
+	for (k = 1; (k < txlog_n) && (pos < len); k++) {
+		if (txlog[k].d[0] != (PCI_CF | sn)) return 0;
+		n = len - pos;
+		if (n > 7) n = 7;
+		memcpy(&out[pos], &txlog[k].d[1], n);
+		pos += n;
+		sn = (sn + 1) & 0x0F;
+	}
+	return (pos == len) ? len : 0;
+}
+
+static void fill(u8 *p, unsigned len, unsigned seed) {
+	unsigned i;
+	for (i = 0; i < len; i++) {
+		p[i] = (u8) ((i * 131) + seed);
+	}
+	return;
+}
+
+
+/******** kernel -> tester */
+
+static void test_tx_sf(void) {
+	static const u8 resp[5] = {0x7F, 0xBC, 0x78, 0x12, 0x34};
+	struct tx_seg seg = {resp, sizeof(resp)};
+	unsigned i;
+
+	reset();
+	can_send(&seg, 1);
+	hcan_step();	//let the last frame out
+	CHECK(txlog_n == 1);
+	CHECK(txlog[0].d[0] == (PCI_SF | 5));
+	CHECK(!memcmp(&txlog[0].d[1], resp, 5));
+	for (i = 6; i < 8; i++) {
+		CHECK(txlog[0].d[i] == CAN_PAD);
+	}
+	return;
+}
+
+static void test_tx_multi(void) {
+	static u8 h[3] = {0x7D, 0x01, 0x02};
+	static u8 p[1500];
+	static u8 out[CAN_MAXMSG];
+	struct tx_seg seg[3] = {{h, 3}, {p, 0}, {p, sizeof(p)}};	//empty segment in the middle
+
+	reset();
+	fill(p, sizeof(p), 1);
+	fc_mode = FC_CTS;
+	can_send(seg, 3);
+	hcan_step();
+	CHECK(txlog_n == 1 + ((1503 - 6 + 6) / 7));
+	CHECK(txlog_message(out, sizeof(out)) == 1503);
+	CHECK(!memcmp(out, h, 3));
+	CHECK(!memcmp(&out[3], p, sizeof(p)));
+	CHECK(fc_sent == 1);
+	return;
+}
+
+static void test_tx_blocks(void) {
+	static u8 p[200];
+	static u8 out[CAN_MAXMSG];
+	struct tx_seg seg = {p, sizeof(p)};
+	unsigned k, ncf;
+	u32 st = MCLK_GETTS(5);
+
+	reset();
+	fill(p, sizeof(p), 2);
+	fc_mode = FC_CTS;
+	tst_bs = 4;
+	tst_st = 5;	//ms
+	can_send(&seg, 1);
+	hcan_step();
+
+	ncf = (sizeof(p) - 6 + 6) / 7;
+	CHECK(txlog_n == 1 + ncf);
+	CHECK(txlog_message(out, sizeof(out)) == sizeof(p));
+	CHECK(!memcmp(out, p, sizeof(p)));
+	CHECK(fc_sent == 1 + (ncf / 4));	//after FF, then after each full block
+	/* STmin between CFs of the same block */
+	for (k = 2; k < txlog_n; k++) {
+		if (((k - 1) % 4) == 0) continue;	//first CF of a block : paced by the FC
+		CHECK((txlog[k].ts - txlog[k - 1].ts) >= st);
+	}
+
+	/* 100us units */
+	reset();
+	fc_mode = FC_CTS;
+	tst_st = 0xF5;
+	can_send(&seg, 1);
+	hcan_step();
+	CHECK(txlog_message(out, sizeof(out)) == sizeof(p));
+	for (k = 2; k < txlog_n; k++) {
+		CHECK((txlog[k].ts - txlog[k - 1].ts) >= (MCLK_GETTS(5) / 10));
+	}
+	return;
+}
+
+static void test_tx_wait(void) {
+	static u8 p[40];
+	static u8 out[CAN_MAXMSG];
+	struct tx_seg seg = {p, sizeof(p)};
+
+	reset();
+	fill(p, sizeof(p), 3);
+	fc_mode = FC_WAIT2;
+	can_send(&seg, 1);
+	hcan_step();
+	CHECK(txlog_message(out, sizeof(out)) == sizeof(p));
+	CHECK(!memcmp(out, p, sizeof(p)));
+	return;
+}
+
+static void test_tx_overflow(void) {
+	static u8 p[40];
+	struct tx_seg seg = {p, sizeof(p)};
+
+	reset();
+	fc_mode = FC_OVFLW;
+	can_send(&seg, 1);
+	hcan_step();
+	CHECK(txlog_n == 1);
+	CHECK((txlog[0].d[0] & 0xF0) == PCI_FF);
+	return;
+}
+
+/* N_Bs : no FC at all */
+static void test_tx_nbs(void) {
+	static u8 p[40];
+	struct tx_seg seg = {p, sizeof(p)};
+	u32 t0;
+
+	reset();
+	fc_mode = FC_NONE;
+	t0 = sim_now;
+	can_send(&seg, 1);
+	CHECK(txlog_n == 1);
+	CHECK((sim_now - t0) >= MCLK_GETTS(N_TIMEOUT));
+	CHECK((sim_now - t0) < MCLK_GETTS(N_TIMEOUT + 100));
+	return;
+}
+
+/* frame never acknowledged : the next one aborts it after N_TIMEOUT instead of hanging */
+static void test_tx_noack(void) {
+	static const u8 resp[3] = {0x7F, 0xBC, 0x78};
+	struct tx_seg seg = {resp, sizeof(resp)};
+	u32 t0;
+
+	reset();
+	bus_ok = 0;
+	can_send(&seg, 1);
+	t0 = sim_now;
+	can_send(&seg, 1);
+	CHECK(aborts == 1);
+	CHECK((sim_now - t0) >= MCLK_GETTS(N_TIMEOUT));
+	CHECK(txlog_n == 0);
+	bus_ok = 1;
+	hcan_step();
+	CHECK(txlog_n == 1);
+	return;
+}
+
+/* the TX abort never completes either : CAN turns itself off instead of hanging */
+static void test_tx_stuck(void) {
+	static const u8 resp[3] = {0x7F, 0xBC, 0x78};
+	struct tx_seg seg = {resp, sizeof(resp)};
+	u32 t0;
+
+	reset();
+	bus_ok = 0;
+	abort_stuck = 1;
+	can_send(&seg, 1);
+	t0 = sim_now;
+	can_send(&seg, 1);
+	CHECK((sim_now - t0) < MCLK_GETTS(N_TIMEOUT + HCAN_TIMEOUT + 10));
+	CHECK(!can_isup());
+	t0 = sim_now;
+	can_send(&seg, 1);
+	can_txwait();
+	CHECK((sim_now - t0) < 10);
+	CHECK(txlog_n == 0);
+	return;
+}
+
+
+/******** startup */
+
+/* HCAN0 never leaves / enters reset : can_init() gives up, and CAN calls do nothing */
+static void test_init_dead(void) {
+	static const u8 resp[3] = {0x7F, 0xBC, 0x78};
+	u8 f[8] = {0x02, 0x3E, 0x00, CAN_PAD, CAN_PAD, CAN_PAD, CAN_PAD, CAN_PAD};
+	struct tx_seg seg = {resp, sizeof(resp)};
+	u8 buf[8];
+	u32 t0;
+
+	reset();
+	hcan_dead = 1;
+	t0 = sim_now;
+	CHECK(!can_init());
+	CHECK((sim_now - t0) < MCLK_GETTS(HCAN_TIMEOUT + 10));
+	CHECK(!can_isup());
+	can_send(&seg, 1);
+	CHECK(txlog_n == 0);
+	tester_queue(f, 8, 0);
+	hcan_step();
+	CHECK(can_poll(buf, sizeof(buf)) == 0);
+
+	hcan_dead = 0;
+	CHECK(can_init());
+	return;
+}
+
+
+/******** tester -> kernel */
+
+static void test_rx_sf(void) {
+	u8 f[8] = {0x03, 0x81, 0xAA, 0xBB, CAN_PAD, CAN_PAD, CAN_PAD, CAN_PAD};
+	u8 buf[16];
+
+	reset();
+	tester_queue(f, 8, 0);
+	CHECK(poll_all(buf, sizeof(buf)) == 3);
+	CHECK(!memcmp(buf, &f[1], 3));
+	CHECK(txlog_n == 0);
+
+	/* length >= DLC : invalid */
+	reset();
+	tester_queue(f, 3, 0);
+	CHECK(poll_all(buf, sizeof(buf)) == 0);
+	return;
+}
+
+/* send <len> bytes as FF + CFs, honouring the kernel's FC
+ * @return can_poll() result
+ */
+static unsigned rx_request(const u8 *req, unsigned len, u8 *buf, unsigned maxlen, unsigned *nfc) {
+	u8 f[8];
+	unsigned pos, n, r, blk = 0;
+	unsigned bs = 0;
+	u8 sn = 1;
+
+	*nfc = 0;
+	f[0] = PCI_FF | (len >> 8);
+	f[1] = len & 0xFF;
+	memcpy(&f[2], req, 6);
+	tester_queue(f, 8, 0);
+	r = poll_all(buf, maxlen);
+	if (r || (txlog_n != 1) || (txlog[0].d[0] != (PCI_FC | FS_CTS))) return r;
+	*nfc = 1;
+	bs = txlog[0].d[1];
+
+	for (pos = 6; pos < len; pos += n) {
+		n = len - pos;
+		if (n > 7) n = 7;
+		memset(f, CAN_PAD, 8);
+		f[0] = PCI_CF | sn;
+		memcpy(&f[1], &req[pos], n);
+		tester_queue(f, 8, 0);
+		sn = (sn + 1) & 0x0F;
+		r = poll_all(buf, maxlen);
+		if (r) return r;
+		if (bs && (++blk == bs)) {
+			blk = 0;
+			if (txlog_n != (*nfc + 1)) return 0;	//expected a FC
+			*nfc += 1;
+		}
+	}
+	return 0;
+}
+
+static void test_rx_multi(void) {
+	static u8 req[2016];
+	static u8 buf[2016];
+	unsigned nfc;
+	unsigned ncf = (sizeof(req) - 6 + 6) / 7;
+
+	reset();
+	fill(req, sizeof(req), 4);
+	CHECK(rx_request(req, sizeof(req), buf, sizeof(buf), &nfc) == sizeof(req));
+	CHECK(!memcmp(buf, req, sizeof(req)));
+	CHECK(nfc == 1);
+
+	reset();
+	can_setfc(4, 0);
+	CHECK(rx_request(req, sizeof(req), buf, sizeof(buf), &nfc) == sizeof(req));
+	CHECK(!memcmp(buf, req, sizeof(req)));
+	CHECK(nfc == 1 + ((ncf - 1) / 4));	//no FC after the last CF
+	CHECK(txlog[1].d[1] == 4);
+	return;
+}
+
+static void test_rx_overflow(void) {
+	u8 f[8] = {PCI_FF | 0x0F, 0xFF, 1, 2, 3, 4, 5, 6};
+	u8 buf[2016];
+
+	reset();
+	tester_queue(f, 8, 0);
+	CHECK(poll_all(buf, sizeof(buf)) == 0);
+	CHECK(txlog_n == 1);
+	CHECK(txlog[0].d[0] == (PCI_FC | FS_OVFLW));
+	return;
+}
+
+static void test_rx_badsn(void) {
+	u8 ff[8] = {PCI_FF | 0, 20, 1, 2, 3, 4, 5, 6};
+	u8 cf[8] = {PCI_CF | 2, 7, 8, 9, 10, 11, 12, 13};
+	u8 buf[64];
+
+	reset();
+	tester_queue(ff, 8, 0);
+	tester_queue(cf, 8, 0);	//SN 2 instead of 1
+	cf[0] = PCI_CF | 1;
+	tester_queue(cf, 8, 0);
+	cf[0] = PCI_CF | 2;
+	tester_queue(cf, 8, 0);
+	CHECK(poll_all(buf, sizeof(buf)) == 0);
+	return;
+}
+
+/* N_Cr : CF after more than N_TIMEOUT is dropped, and the next request still works */
+static void test_rx_ncr(void) {
+	u8 ff[8] = {PCI_FF | 0, 13, 1, 2, 3, 4, 5, 6};
+	u8 cf[8] = {PCI_CF | 1, 7, 8, 9, 10, 11, 12, 13};
+	u8 sf[8] = {0x01, 0x3E, CAN_PAD, CAN_PAD, CAN_PAD, CAN_PAD, CAN_PAD, CAN_PAD};
+	u8 buf[64];
+
+	reset();
+	tester_queue(ff, 8, 0);
+	tester_queue(cf, 8, MCLK_GETTS(N_TIMEOUT + 10));
+	CHECK(poll_all(buf, sizeof(buf)) == 0);
+
+	tester_queue(ff, 8, 0);
+	tester_queue(cf, 8, MCLK_GETTS(N_TIMEOUT - 10));	//just in time
+	CHECK(poll_all(buf, sizeof(buf)) == 13);
+	CHECK(!memcmp(buf, &ff[2], 6));
+	CHECK(!memcmp(&buf[6], &cf[1], 7));
+
+	tester_queue(sf, 8, 0);
+	CHECK(poll_all(buf, sizeof(buf)) == 1);
+	CHECK(buf[0] == 0x3E);
+	return;
+}
+
+/* can_rxbusy() : set from FF to last CF, so cmd_loop() can keep K-line away from the buffer */
+static void test_rx_busy(void) {
+	u8 ff[8] = {PCI_FF | 0, 13, 1, 2, 3, 4, 5, 6};
+	u8 cf[8] = {PCI_CF | 1, 7, 8, 9, 10, 11, 12, 13};
+	u8 buf[64];
+
+	reset();
+	CHECK(!can_rxbusy());
+	tester_queue(ff, 8, 0);
+	hcan_step();
+	CHECK(can_poll(buf, sizeof(buf)) == 0);
+	CHECK(can_rxbusy());
+	tester_queue(cf, 8, 0);
+	hcan_step();
+	CHECK(can_poll(buf, sizeof(buf)) == 13);
+	CHECK(!can_rxbusy());
+
+	tester_queue(ff, 8, 0);
+	hcan_step();
+	CHECK(can_poll(buf, sizeof(buf)) == 0);
+	CHECK(can_rxbusy());
+	sim_now += MCLK_GETTS(N_TIMEOUT + 10);
+	CHECK(can_poll(buf, sizeof(buf)) == 0);
+	CHECK(!can_rxbusy());	//N_Cr expired
+	return;
+}
+
+int main(void) {
+	test_tx_sf();
+	test_tx_multi();
+	test_tx_blocks();
+	test_tx_wait();
+	test_tx_overflow();
+	test_tx_nbs();
+	test_tx_noack();
+	test_tx_stuck();
+	test_init_dead();
+	test_rx_sf();
+	test_rx_multi();
+	test_rx_overflow();
+	test_rx_badsn();
+	test_rx_ncr();
+	test_rx_busy();
+
+	if (failures) {
+		printf("test_can_tp : %u failure(s)\n", failures);
+		return 1;
+	}
+	printf("test_can_tp : ok\n");
+	return 0;
+}